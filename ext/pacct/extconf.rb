@@ -2,6 +2,11 @@ require 'mkmf'
 
 $CFLAGS << ' -Werror'
 
+#Lets small TypedData structs live inside their object slots (Ruby 3.3+)
+have_const('RUBY_TYPED_EMBEDDABLE', 'ruby.h')
+#Deduplicated frozen Strings (Ruby 3.0+)
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
+
 =begin
 if ENV['COVERAGE']
   $CFLAGS << ' -fprofile-arcs -ftest-coverage'
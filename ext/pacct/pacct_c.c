@@ -1,14 +1,26 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <fcntl.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <unistd.h>
 #include <sys/acct.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "ruby.h"
+#include "ruby/encoding.h"
+#include "ruby/random.h"
+#include "ruby/thread.h"
 
 static char const* validFileModes[] = {
   "rb",
@@ -27,15 +39,49 @@ static VALUE cNoMemoryError;
 static VALUE cSystemCallError;
 
 //Identifiers
-static ID id_at;
 static ID id_new;
 static ID id_to_i;
+static ID id_where;
+static ID id_top;
+static ID id_command_name;
+static ID id_user_id;
+static ID id_group_id;
+static ID id_process_id;
+static ID id_entry;
+static ID id_cpu_time;
+static ID id_wall_time;
+static ID id_memory;
+static ID id_processes;
+static ID id_exact;
+static ID id_cursor;
+static ID id_each_entry;
+static ID id_buffer_size;
+static ID id_depth;
+static ID id_stride;
+static ID id_fraction;
+static ID id_seed;
+
+//Caches of user and group names
+//
+//These are native rather than Ruby Hashes so that every Ractor can share them.
+#define NAME_CACHE_BUCKETS 256
+
+typedef struct NameCacheNode {
+  uint32_t id;
+  char* name;
+  struct NameCacheNode* next;
+} NameCacheNode;
+
+typedef struct {
+  pthread_mutex_t lock;
+  //Filled by ID -> name lookups
+  NameCacheNode* by_id[NAME_CACHE_BUCKETS];
+  //Filled by name -> ID lookups
+  NameCacheNode* by_name[NAME_CACHE_BUCKETS];
+} NameCache;
 
-//To do: where is a better place to put these?
-static VALUE known_users_by_name = Qnil;
-static VALUE known_groups_by_name = Qnil;
-static VALUE known_users_by_id = Qnil;
-static VALUE known_groups_by_id = Qnil;
+static NameCache user_cache = {PTHREAD_MUTEX_INITIALIZER, {0}, {0}};
+static NameCache group_cache = {PTHREAD_MUTEX_INITIALIZER, {0}, {0}};
 
 //System parameters
 static int pageSize;
@@ -77,6 +123,18 @@ static comp_t ulong_to_comp_t(unsigned long l) {
   return ((l >> bits) & 0x1fff) | ((bits / 3) << 13);
 }
 
+//Returns a frozen binary String with the given contents
+//
+//Where the VM supports it, the String comes from its table of deduplicated
+//strings, so repeated names don't allocate new objects.
+static VALUE pacct_interned_str(const char* ptr, long len) {
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str(ptr, len, rb_ascii8bit_encoding());
+#else
+  return rb_obj_freeze(rb_str_new(ptr, len));
+#endif
+}
+
 //Checks the result of a call, raising an error if it fails
 //To do: handle non-integer values in the rb_raise format string?
 #define CHECK_CALL(expr, expected_result) \
@@ -98,12 +156,242 @@ static comp_t ulong_to_comp_t(unsigned long l) {
     } \
   } \
 
+//Entries are small enough to live inside the object slot on Rubies that allow it.
+#ifdef HAVE_CONST_RUBY_TYPED_EMBEDDABLE
+#define PACCT_TYPED_EMBEDDABLE RUBY_TYPED_EMBEDDABLE
+#else
+#define PACCT_TYPED_EMBEDDABLE 0
+#endif
+
+//Frozen entries can be shared between Ractors.
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+//Number of records read per call to fread() by methods that scan the file
+#define RECORDS_PER_READ 1024
+
 #define ENSURE_ALLOCATED(ptr) if(!ptr) rb_raise(cNoMemoryError, "Out of memory");
 
+static size_t name_cache_hash(const char* name) {
+  size_t hash = 5381;
+  while(*name) {
+    hash = hash * 33 + (unsigned char)*name++;
+  }
+  return hash % NAME_CACHE_BUCKETS;
+}
+
+//Adds a node to a bucket; the cache's lock must be held.
+//
+//Nodes are never removed, so names returned from the cache stay valid.
+static const char* name_cache_insert(NameCacheNode** bucket, uint32_t id, const char* name) {
+  NameCacheNode* node = malloc(sizeof(NameCacheNode));
+  size_t name_len = strlen(name);
+  if(!node) {
+    return NULL;
+  }
+  node->name = malloc(name_len + 1);
+  if(!node->name) {
+    free(node);
+    return NULL;
+  }
+  memcpy(node->name, name, name_len + 1);
+  node->id = id;
+  node->next = *bucket;
+  *bucket = node;
+  return node->name;
+}
+
+//Looks up the name for an ID, asking the OS if it isn't cached
+//
+//The lookup function fills buf with the name and returns 0, or returns an
+//errno value. Returns NULL and sets *e if the name can't be found.
+static const char* name_cache_get_name(NameCache* cache, uint32_t id, int (*lookup)(uint32_t, char*, size_t), int* e) {
+  NameCacheNode** bucket = cache->by_id + id % NAME_CACHE_BUCKETS;
+  NameCacheNode* node;
+  const char* name = NULL;
+  char buf[512];
+
+  pthread_mutex_lock(&cache->lock);
+  for(node = *bucket; node; node = node->next) {
+    if(node->id == id) {
+      name = node->name;
+      break;
+    }
+  }
+  if(!name) {
+    *e = lookup(id, buf, sizeof(buf));
+    if(*e == 0) {
+      name = name_cache_insert(bucket, id, buf);
+      if(!name) {
+        *e = ENOMEM;
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return name;
+}
+
+//Looks up the ID for a name, asking the OS if it isn't cached
+//
+//The lookup function stores the ID and returns 0, or returns an errno value.
+//Returns 0 on success or an errno value.
+static int name_cache_get_id(NameCache* cache, const char* name, int (*lookup)(const char*, uint32_t*), uint32_t* id) {
+  NameCacheNode** bucket = cache->by_name + name_cache_hash(name);
+  NameCacheNode* node;
+  int e = 0;
+
+  pthread_mutex_lock(&cache->lock);
+  for(node = *bucket; node; node = node->next) {
+    if(strcmp(node->name, name) == 0) {
+      *id = node->id;
+      break;
+    }
+  }
+  if(!node) {
+    e = lookup(name, id);
+    if(e == 0 && !name_cache_insert(bucket, *id, name)) {
+      e = ENOMEM;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return e;
+}
+
+//Reentrant passwd/group lookups for the name caches
+//
+//Each returns 0 on success, ENODATA if there is no such entry, or another
+//errno value.
+static int os_user_name(uint32_t id, char* name, size_t name_len) {
+  struct passwd pw, *result = NULL;
+  size_t buf_len = 1024;
+  char* buf = NULL;
+  int rc;
+
+  do {
+    char* new_buf = realloc(buf, buf_len);
+    if(!new_buf) {
+      free(buf);
+      return ENOMEM;
+    }
+    buf = new_buf;
+    rc = getpwuid_r(id, &pw, buf, buf_len, &result);
+    buf_len *= 2;
+  } while(rc == ERANGE);
+
+  if(rc == 0) {
+    if(result) {
+      snprintf(name, name_len, "%s", pw.pw_name);
+    } else {
+      rc = ENODATA;
+    }
+  }
+  free(buf);
+  return rc;
+}
+
+static int os_user_id(const char* name, uint32_t* id) {
+  struct passwd pw, *result = NULL;
+  size_t buf_len = 1024;
+  char* buf = NULL;
+  int rc;
+
+  do {
+    char* new_buf = realloc(buf, buf_len);
+    if(!new_buf) {
+      free(buf);
+      return ENOMEM;
+    }
+    buf = new_buf;
+    rc = getpwnam_r(name, &pw, buf, buf_len, &result);
+    buf_len *= 2;
+  } while(rc == ERANGE);
+
+  if(rc == 0) {
+    if(result) {
+      *id = pw.pw_uid;
+    } else {
+      rc = ENODATA;
+    }
+  }
+  free(buf);
+  return rc;
+}
+
+static int os_group_name(uint32_t id, char* name, size_t name_len) {
+  struct group gr, *result = NULL;
+  size_t buf_len = 1024;
+  char* buf = NULL;
+  int rc;
+
+  do {
+    char* new_buf = realloc(buf, buf_len);
+    if(!new_buf) {
+      free(buf);
+      return ENOMEM;
+    }
+    buf = new_buf;
+    rc = getgrgid_r(id, &gr, buf, buf_len, &result);
+    buf_len *= 2;
+  } while(rc == ERANGE);
+
+  if(rc == 0) {
+    if(result) {
+      snprintf(name, name_len, "%s", gr.gr_name);
+    } else {
+      rc = ENODATA;
+    }
+  }
+  free(buf);
+  return rc;
+}
+
+static int os_group_id(const char* name, uint32_t* id) {
+  struct group gr, *result = NULL;
+  size_t buf_len = 1024;
+  char* buf = NULL;
+  int rc;
+
+  do {
+    char* new_buf = realloc(buf, buf_len);
+    if(!new_buf) {
+      free(buf);
+      return ENOMEM;
+    }
+    buf = new_buf;
+    rc = getgrnam_r(name, &gr, buf, buf_len, &result);
+    buf_len *= 2;
+  } while(rc == ERANGE);
+
+  if(rc == 0) {
+    if(result) {
+      *id = gr.gr_gid;
+    } else {
+      rc = ENODATA;
+    }
+  }
+  free(buf);
+  return rc;
+}
+
+struct ReadAhead;
+
 typedef struct {
   FILE* file;
   char* filename;
   long num_entries;
+  //Read-ahead settings (see read_ahead); a depth of 0 disables read-ahead.
+  size_t read_ahead_size;
+  int read_ahead_depth;
+  //Whether the file's filesystem can collapse ranges: 1 if so, -1 if not,
+  //or 0 if that isn't known yet
+  int collapse_support;
+  //Incremented whenever drop_before changes the file
+  unsigned long generation;
+  //The read-ahead iteration in progress, if any
+  struct ReadAhead* read_ahead;
 } PacctLog;
 
 static void pacct_log_free(void* p) {
@@ -113,9 +401,39 @@ static void pacct_log_free(void* p) {
     log->file = NULL;
   }
   free(log->filename);
-  free(p);
+  xfree(p);
 }
 
+static size_t pacct_log_memsize(const void* p) {
+  const PacctLog* log = (const PacctLog*) p;
+  size_t size = sizeof(PacctLog);
+  if(log->filename) {
+    size += strlen(log->filename) + 1;
+  }
+  return size;
+}
+
+//Neither type holds references to Ruby objects, so they need no mark or
+//compaction callbacks.
+static const rb_data_type_t pacct_log_type = {
+  "Pacct::Log",
+  {0, pacct_log_free, pacct_log_memsize,},
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+//An embedded record is already counted as part of its object's slot.
+static size_t pacct_entry_memsize(const void* p) {
+  return PACCT_TYPED_EMBEDDABLE ? 0 : sizeof(struct acct_v3);
+}
+
+static const rb_data_type_t pacct_entry_type = {
+  "Pacct::Entry",
+  {0, RUBY_TYPED_DEFAULT_FREE, pacct_entry_memsize,},
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE | PACCT_TYPED_EMBEDDABLE,
+};
+
 /*
  *call-seq:
  *  new(filename)
@@ -130,7 +448,7 @@ static VALUE pacct_log_new(int argc, VALUE* argv, VALUE class) {
   init_args[1] = Qnil;
   rb_scan_args(argc, argv, "11", init_args, init_args + 1);
 
-  log = Data_Make_Struct(class, PacctLog, 0, pacct_log_free, ptr);
+  log = TypedData_Make_Struct(class, PacctLog, &pacct_log_type, ptr);
 
   ptr->file = NULL;
   ptr->num_entries = 0;
@@ -167,7 +485,7 @@ static VALUE pacct_log_init(VALUE self, VALUE filename, VALUE mode) {
     rb_raise(rb_eIOError, "Unable to open file '%s'", c_filename);
   }
 
-  Data_Get_Struct(self, PacctLog, log);
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
 
   log->file = acct;
   c_filename_len = strlen(c_filename);
@@ -195,13 +513,22 @@ static void pacct_log_check_closed(PacctLog* log) {
     }
 }
 
+//Raises a SystemCallError for the given errno with a message about the log
+static void pacct_log_raise_errno(PacctLog* log, int e, const char* action) {
+  char buf[512];
+  VALUE err;
+  snprintf(buf, sizeof(buf), "Unable to %s accounting file '%s'", action, log->filename);
+  err = rb_funcall(cSystemCallError, id_new, 2, rb_str_new2(buf), INT2NUM(e));
+  rb_exc_raise(err);
+}
+
 /*
  *Closes the log file
  */
 static VALUE pacct_log_close(VALUE self) {
   PacctLog* log;
 
-  Data_Get_Struct(self, PacctLog, log);
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
 
   if(log->file) {
     fclose(log->file);
@@ -213,7 +540,7 @@ static VALUE pacct_log_close(VALUE self) {
 
 static VALUE pacct_entry_new(PacctLog* log) {
   struct acct_v3* ptr;
-  VALUE entry = Data_Make_Struct(cEntry, struct acct_v3, 0, free, ptr);
+  VALUE entry = TypedData_Make_Struct(cEntry, struct acct_v3, &pacct_entry_type, ptr);
   if(log) {
     size_t entries_read;
     // TODO: just let fread() catch this case?
@@ -230,31 +557,607 @@ static VALUE pacct_entry_new(PacctLog* log) {
   return entry;
 }
 
+//Creates an entry holding a copy of the given record
+static VALUE pacct_entry_from_record(const struct acct_v3* record) {
+  struct acct_v3* ptr;
+  VALUE entry = TypedData_Make_Struct(cEntry, struct acct_v3, &pacct_entry_type, ptr);
+  memcpy(ptr, record, sizeof(struct acct_v3));
+  return entry;
+}
+
 //This is the version of pacct_entry_new that is actually exposed to Ruby.
 static VALUE ruby_pacct_entry_new(VALUE self) {
   return pacct_entry_new(NULL);
 }
 
+//Background read-ahead
+//
+//A native thread fills a ring of buffers with pread() while the Ruby thread
+//decodes and yields the records in the oldest filled buffer.
+
+#define DEFAULT_READ_AHEAD_SIZE (1024 * 1024)
+#define DEFAULT_READ_AHEAD_DEPTH 2
+
+typedef struct ReadAhead {
+  PacctLog* log;
+  //A duplicate of the log's descriptor that stays valid if the block closes
+  //the log
+  int fd;
+  off_t start;
+  off_t end;
+  size_t buffer_size;
+  int depth;
+  char** buffers;
+  size_t* lengths;
+  pthread_mutex_t lock;
+  pthread_cond_t filled_cond;
+  pthread_cond_t free_cond;
+  pthread_t thread;
+  int thread_started;
+  //The following are protected by lock.
+  int head;
+  int tail;
+  int count;
+  int done;
+  int stop;
+  int interrupted;
+  int error;
+  //Only used by the Ruby thread
+  off_t consumed;
+  unsigned long generation;
+  int restart;
+  struct ReadAhead* outer;
+} ReadAhead;
+
+static void* read_ahead_thread(void* p) {
+  ReadAhead* ra = (ReadAhead*) p;
+  off_t offset = ra->start;
+  int e = 0;
+
+  while(offset < ra->end) {
+    size_t len = ra->end - offset < (off_t)ra->buffer_size ? (size_t)(ra->end - offset) : ra->buffer_size;
+    size_t num_read = 0;
+    char* buf;
+    int stop;
+
+    pthread_mutex_lock(&ra->lock);
+    while(ra->count == ra->depth && !ra->stop) {
+      pthread_cond_wait(&ra->free_cond, &ra->lock);
+    }
+    buf = ra->buffers[ra->tail];
+    stop = ra->stop;
+    pthread_mutex_unlock(&ra->lock);
+    if(stop) {
+      break;
+    }
+
+    //Ask the kernel to start on the buffers after this one.
+    posix_fadvise(ra->fd, offset + len, (off_t)ra->buffer_size * ra->depth, POSIX_FADV_WILLNEED);
+
+    while(num_read < len) {
+      ssize_t result = pread(ra->fd, buf + num_read, len - num_read, offset + num_read);
+      if(result < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        e = errno;
+        break;
+      }
+      if(result == 0) {
+        //The file was truncated under us.
+        e = EIO;
+        break;
+      }
+      num_read += result;
+    }
+    if(e) {
+      break;
+    }
+    offset += len;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->lengths[ra->tail] = len;
+    ra->tail = (ra->tail + 1) % ra->depth;
+    ++ra->count;
+    pthread_cond_signal(&ra->filled_cond);
+    pthread_mutex_unlock(&ra->lock);
+  }
+
+  pthread_mutex_lock(&ra->lock);
+  ra->error = e;
+  ra->done = 1;
+  pthread_cond_signal(&ra->filled_cond);
+  pthread_mutex_unlock(&ra->lock);
+
+  return NULL;
+}
+
+//Waits for a filled buffer; runs without the GVL.
+static void* read_ahead_wait(void* p) {
+  ReadAhead* ra = (ReadAhead*) p;
+  pthread_mutex_lock(&ra->lock);
+  while(ra->count == 0 && !ra->done && !ra->interrupted) {
+    pthread_cond_wait(&ra->filled_cond, &ra->lock);
+  }
+  pthread_mutex_unlock(&ra->lock);
+  return NULL;
+}
+
+static void read_ahead_interrupt(void* p) {
+  ReadAhead* ra = (ReadAhead*) p;
+  pthread_mutex_lock(&ra->lock);
+  ra->interrupted = 1;
+  pthread_cond_broadcast(&ra->filled_cond);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+static VALUE read_ahead_each(VALUE p) {
+  ReadAhead* ra = (ReadAhead*) p;
+  int e;
+
+  e = pthread_create(&ra->thread, NULL, read_ahead_thread, ra);
+  if(e) {
+    pacct_log_raise_errno(ra->log, e, "start read-ahead for");
+  }
+  ra->thread_started = 1;
+
+  for(;;) {
+    char* buf;
+    size_t len, i;
+    int count, done;
+
+    pthread_mutex_lock(&ra->lock);
+    count = ra->count;
+    done = ra->done;
+    pthread_mutex_unlock(&ra->lock);
+    if(count == 0) {
+      if(done) {
+        if(!ra->error && (off_t)ra->log->num_entries * (off_t)sizeof(struct acct_v3) > ra->end) {
+          //The block appended records (e.g. with write_entry); read those too.
+          ra->restart = 1;
+          return Qnil;
+        }
+        break;
+      }
+      rb_thread_call_without_gvl(read_ahead_wait, ra, read_ahead_interrupt, ra);
+      pthread_mutex_lock(&ra->lock);
+      ra->interrupted = 0;
+      pthread_mutex_unlock(&ra->lock);
+      rb_thread_check_ints();
+      continue;
+    }
+
+    buf = ra->buffers[ra->head];
+    len = ra->lengths[ra->head];
+    for(i = 0; i < len; i += sizeof(struct acct_v3)) {
+      VALUE entry = pacct_entry_from_record((struct acct_v3*)(buf + i));
+      ra->consumed += sizeof(struct acct_v3);
+      rb_yield(entry);
+      pacct_log_check_closed(ra->log);
+      if(ra->log->generation != ra->generation) {
+        //The buffered records are stale; drop_before has already moved the
+        //read position to match the new contents.
+        ra->restart = 1;
+        return Qnil;
+      }
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    ra->head = (ra->head + 1) % ra->depth;
+    --ra->count;
+    pthread_cond_signal(&ra->free_cond);
+    pthread_mutex_unlock(&ra->lock);
+  }
+
+  if(ra->error) {
+    pacct_log_raise_errno(ra->log, ra->error, "read");
+  }
+
+  return Qnil;
+}
+
+static VALUE read_ahead_cleanup(VALUE p) {
+  ReadAhead* ra = (ReadAhead*) p;
+  int i;
+
+  if(ra->thread_started) {
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->free_cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+  }
+  pthread_mutex_destroy(&ra->lock);
+  pthread_cond_destroy(&ra->filled_cond);
+  pthread_cond_destroy(&ra->free_cond);
+  for(i = 0; i < ra->depth; ++i) {
+    free(ra->buffers[i]);
+  }
+  free(ra->buffers);
+  free(ra->lengths);
+  close(ra->fd);
+  ra->log->read_ahead = ra->outer;
+
+  //Leave the file where sequential reading would have, unless drop_before has
+  //already moved it.
+  if(ra->log->file && ra->generation == ra->log->generation) {
+    fseek(ra->log->file, ra->start + ra->consumed, SEEK_SET);
+  }
+
+  return Qnil;
+}
+
+//Yields the entries from start onward using the log's read-ahead settings
+static VALUE each_entry_read_ahead(VALUE self, PacctLog* log, long start) {
+  ReadAhead ra;
+  int i;
+
+  do {
+    //Anything that stdio is holding must reach the file before pread() sees it.
+    if(fflush(log->file) != 0) {
+      pacct_log_raise_errno(log, errno, "flush");
+    }
+
+    memset(&ra, 0, sizeof(ra));
+    ra.log = log;
+    ra.start = (off_t)start * sizeof(struct acct_v3);
+    ra.end = (off_t)log->num_entries * sizeof(struct acct_v3);
+    ra.buffer_size = log->read_ahead_size;
+    ra.depth = log->read_ahead_depth;
+    ra.generation = log->generation;
+    ra.outer = log->read_ahead;
+
+    ra.buffers = calloc(ra.depth, sizeof(char*));
+    ra.lengths = calloc(ra.depth, sizeof(size_t));
+    if(!ra.buffers || !ra.lengths) {
+      free(ra.buffers);
+      free(ra.lengths);
+      rb_raise(cNoMemoryError, "Out of memory");
+    }
+    for(i = 0; i < ra.depth; ++i) {
+      ra.buffers[i] = malloc(ra.buffer_size);
+      if(!ra.buffers[i]) {
+        while(i--) {
+          free(ra.buffers[i]);
+        }
+        free(ra.buffers);
+        free(ra.lengths);
+        rb_raise(cNoMemoryError, "Out of memory");
+      }
+    }
+    ra.fd = dup(fileno(log->file));
+    if(ra.fd < 0) {
+      int e = errno;
+      for(i = 0; i < ra.depth; ++i) {
+        free(ra.buffers[i]);
+      }
+      free(ra.buffers);
+      free(ra.lengths);
+      pacct_log_raise_errno(log, e, "read");
+    }
+    posix_fadvise(ra.fd, ra.start, ra.end - ra.start, POSIX_FADV_SEQUENTIAL);
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_cond_init(&ra.filled_cond, NULL);
+    pthread_cond_init(&ra.free_cond, NULL);
+    log->read_ahead = &ra;
+
+    rb_ensure(read_ahead_each, (VALUE)&ra, read_ahead_cleanup, (VALUE)&ra);
+
+    //If the block dropped or appended records, carry on from the current
+    //position.
+    start = ftell(log->file) / (long)sizeof(struct acct_v3);
+  } while(ra.restart);
+  RB_GC_GUARD(self);
+
+  return Qnil;
+}
+
+/*
+ *call-seq:
+ *  read_ahead(buffer_size: 1048576, depth: 2) -> log
+ *
+ *Turns on background read-ahead for each_entry
+ *
+ *A native thread reads the file in chunks of buffer_size bytes, keeping up
+ *to depth chunks ahead of the entry being yielded, so I/O overlaps with the
+ *work done in the block. A depth of 0 turns read-ahead off.
+ *
+ *The reading thread has its own descriptor for the file. If the block
+ *changes the file (e.g. with drop_before), the buffered records are thrown
+ *away and reading continues from the adjusted position. Records that the
+ *block appends (e.g. with write_entry) are yielded once the rest have been,
+ *just as they are without read-ahead.
+ */
+static VALUE read_ahead(int argc, VALUE* argv, VALUE self) {
+  PacctLog* log;
+  VALUE opts, value;
+  long buffer_size = DEFAULT_READ_AHEAD_SIZE;
+  int depth = DEFAULT_READ_AHEAD_DEPTH;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  if(opts != Qnil) {
+    value = rb_hash_lookup(opts, ID2SYM(id_buffer_size));
+    if(value != Qnil) {
+      buffer_size = NUM2LONG(value);
+    }
+    value = rb_hash_lookup(opts, ID2SYM(id_depth));
+    if(value != Qnil) {
+      depth = NUM2INT(value);
+    }
+  }
+  if(buffer_size < (long)sizeof(struct acct_v3)) {
+    rb_raise(rb_eArgError, "The read-ahead buffer must hold at least one record");
+  }
+  if(depth < 0) {
+    rb_raise(rb_eArgError, "The read-ahead depth must not be negative");
+  }
+
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
+
+  //Buffers always hold whole records.
+  log->read_ahead_size = buffer_size - buffer_size % sizeof(struct acct_v3);
+  log->read_ahead_depth = depth;
+
+  return self;
+}
+
+//Sampling
+
+//Generates pseudo-random numbers for sampling (SplitMix64)
+static uint64_t sample_rand(uint64_t* state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+//Returns the initial generator state for the given seed (or a random one if
+//seed is nil)
+static uint64_t sample_seed(VALUE seed) {
+  if(seed == Qnil) {
+    return ((uint64_t)rb_genrand_ulong_limited(0xffffffffUL) << 32) | rb_genrand_ulong_limited(0xffffffffUL);
+  }
+  return NUM2ULL(seed);
+}
+
+//Returns the number of records to skip before the next one that is kept
+//when each record is kept with probability fraction
+static long sample_gap(uint64_t* state, double fraction) {
+  double u;
+  double gap;
+  if(fraction >= 1.0) {
+    return 0;
+  }
+  //Uniform in (0, 1]
+  u = ((sample_rand(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+  gap = floor(log(u) / log1p(-fraction));
+  return gap > (double)LONG_MAX ? LONG_MAX : (long)gap;
+}
+
+//Reads the record at the given index without moving the file position
+//
+//Returns 0 on success or -1 on failure.
+static int pacct_log_read_record_at(PacctLog* log, long index, struct acct_v3* record) {
+  off_t offset = (off_t)index * sizeof(struct acct_v3);
+  size_t num_read = 0;
+
+  while(num_read < sizeof(struct acct_v3)) {
+    ssize_t result = pread(fileno(log->file), (char*)record + num_read, sizeof(struct acct_v3) - num_read, offset + num_read);
+    if(result < 0 && errno == EINTR) {
+      continue;
+    }
+    if(result <= 0) {
+      return -1;
+    }
+    num_read += result;
+  }
+
+  return 0;
+}
+
+static int sample_index_cmp(const void* a, const void* b) {
+  long ia = *(const long*) a;
+  long ib = *(const long*) b;
+  return (ia > ib) - (ia < ib);
+}
+
+//Fills indices with count distinct indices below limit, in ascending order
+//
+//Repeats are drawn again, which takes few passes as long as count is at most
+//half of limit.
+static void sample_distinct(uint64_t* state, long* indices, long count, long limit) {
+  long num_indices = 0, i;
+
+  while(num_indices < count) {
+    long j, num_unique = 0;
+    for(i = num_indices; i < count; ++i) {
+      indices[i] = sample_rand(state) % (uint64_t)limit;
+    }
+    qsort(indices, count, sizeof(long), sample_index_cmp);
+    for(j = 0; j < count; ++j) {
+      if(num_unique == 0 || indices[j] != indices[num_unique - 1]) {
+        indices[num_unique++] = indices[j];
+      }
+    }
+    num_indices = num_unique;
+  }
+}
+
+/*
+ *call-seq:
+ *  sample(n, seed: nil) -> [entry, ...]
+ *
+ *Returns n entries chosen uniformly at random without replacement, in file
+ *order
+ *
+ *Only the chosen records are read. If the file has n entries or fewer, all
+ *of them are returned. Passing the same seed gives the same sample.
+ *
+ *See Pacct::Estimate for computing aggregates and their sampling error.
+ */
+static VALUE sample(int argc, VALUE* argv, VALUE self) {
+  PacctLog* log;
+  VALUE n_value, opts, seed = Qnil, results;
+  uint64_t state;
+  long n, i;
+  long* indices;
+  struct acct_v3* records;
+
+  rb_scan_args(argc, argv, "1:", &n_value, &opts);
+  if(opts != Qnil) {
+    seed = rb_hash_lookup(opts, ID2SYM(id_seed));
+  }
+  n = NUM2LONG(n_value);
+  if(n < 0) {
+    rb_raise(rb_eArgError, "Sample size must not be negative");
+  }
+  state = sample_seed(seed);
+
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
+  pacct_log_check_closed(log);
+
+  if(n > log->num_entries) {
+    n = log->num_entries;
+  }
+  if(fflush(log->file) != 0) {
+    pacct_log_raise_errno(log, errno, "flush");
+  }
+
+  indices = malloc((n ? n : 1) * sizeof(long));
+  ENSURE_ALLOCATED(indices);
+  if(n > log->num_entries / 2) {
+    //Choose the entries to leave out instead so that few draws are repeats.
+    long num_excluded = log->num_entries - n, index, j = 0;
+    long* excluded = malloc((num_excluded ? num_excluded : 1) * sizeof(long));
+    if(!excluded) {
+      free(indices);
+      rb_raise(cNoMemoryError, "Out of memory");
+    }
+    sample_distinct(&state, excluded, num_excluded, log->num_entries);
+    for(index = 0, i = 0; index < log->num_entries; ++index) {
+      if(j < num_excluded && excluded[j] == index) {
+        ++j;
+      } else {
+        indices[i++] = index;
+      }
+    }
+    free(excluded);
+  } else {
+    sample_distinct(&state, indices, n, log->num_entries);
+  }
+
+  records = malloc((n ? n : 1) * sizeof(struct acct_v3));
+  if(!records) {
+    free(indices);
+    rb_raise(cNoMemoryError, "Out of memory");
+  }
+  for(i = 0; i < n; ++i) {
+    if(pacct_log_read_record_at(log, indices[i], records + i) != 0) {
+      free(indices);
+      free(records);
+      rb_raise(rb_eIOError, "Unable to read record from accounting file '%s'", log->filename);
+    }
+  }
+  free(indices);
+
+  results = rb_ary_new2(n);
+  for(i = 0; i < n; ++i) {
+    rb_ary_push(results, pacct_entry_from_record(records + i));
+  }
+  free(records);
+
+  return results;
+}
+
+//Yields every stride-th entry from start, or each entry with probability
+//fraction if fraction is positive
+static VALUE each_entry_sampled(PacctLog* log, long start, long stride, double fraction, VALUE seed) {
+  uint64_t state = sample_seed(seed);
+  long index = start;
+
+  if(fflush(log->file) != 0) {
+    pacct_log_raise_errno(log, errno, "flush");
+  }
+
+  if(fraction > 0) {
+    index += sample_gap(&state, fraction);
+  }
+  while(index >= 0 && index < log->num_entries) {
+    struct acct_v3 record;
+    if(pacct_log_read_record_at(log, index, &record) != 0) {
+      rb_raise(rb_eIOError, "Unable to read record from accounting file '%s'", log->filename);
+    }
+    rb_yield(pacct_entry_from_record(&record));
+    pacct_log_check_closed(log);
+    if(fraction > 0) {
+      long gap = sample_gap(&state, fraction);
+      index = gap >= LONG_MAX - index ? -1 : index + gap + 1;
+    } else {
+      index = stride > LONG_MAX - index ? -1 : index + stride;
+    }
+  }
+
+  return Qnil;
+}
+
 /*
  *call-seq:
  *  each_entry([start]) {|entry, index| ...}
+ *  each_entry([start], stride: k) {|entry| ...}
+ *  each_entry([start], fraction: f, seed: nil) {|entry| ...}
+ *  each_entry(cursor: cursor) {|entry| ...}
  *
  *Yields each entry in the file to the given block
  *
- *If start is given, iteration starts at the entry with that index.
+ *If start is given, iteration starts at the entry with that index. If a
+ *Pacct::Cursor is given, iteration starts after the last entry that it
+ *consumed (see Pacct::Cursor#each_entry).
+ *
+ *With stride, only every k-th entry is yielded. With fraction, each entry is
+ *yielded independently with that probability; passing the same seed gives
+ *the same entries. Either way, only the yielded records are read.
  */
 static VALUE each_entry(int argc, VALUE* argv, VALUE self) {
   PacctLog* log;
-  VALUE start_value;
+  VALUE start_value, opts, seed = Qnil;
   long start = 0;
-  int i = 0;
-
-  rb_scan_args(argc, argv, "01", &start_value);
+  long stride = 1;
+  double fraction = 0;
+
+  rb_scan_args(argc, argv, "01:", &start_value, &opts);
+  if(opts != Qnil) {
+    VALUE cursor = rb_hash_lookup(opts, ID2SYM(id_cursor));
+    VALUE value;
+    if(cursor != Qnil) {
+      if(start_value != Qnil) {
+        rb_raise(rb_eArgError, "A start index can't be combined with a cursor");
+      }
+      return rb_funcall_with_block(cursor, id_each_entry, 1, &self, rb_block_given_p() ? rb_block_proc() : Qnil);
+    }
+    value = rb_hash_lookup(opts, ID2SYM(id_stride));
+    if(value != Qnil) {
+      stride = NUM2LONG(value);
+      if(stride < 1) {
+        rb_raise(rb_eArgError, "stride must be positive");
+      }
+    }
+    value = rb_hash_lookup(opts, ID2SYM(id_fraction));
+    if(value != Qnil) {
+      fraction = NUM2DBL(value);
+      if(!(fraction > 0 && fraction <= 1)) {
+        rb_raise(rb_eArgError, "fraction must be greater than 0 and at most 1");
+      }
+      if(stride != 1) {
+        rb_raise(rb_eArgError, "stride and fraction can't be combined");
+      }
+    }
+    seed = rb_hash_lookup(opts, ID2SYM(id_seed));
+  }
   if(argc && start_value != Qnil) {
     start = NUM2UINT(start_value);
   }
 
-  Data_Get_Struct(self, PacctLog, log);
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
 
   pacct_log_check_closed(log);
 
@@ -262,10 +1165,25 @@ static VALUE each_entry(int argc, VALUE* argv, VALUE self) {
     rb_raise(rb_eRangeError, "Index %li is out of range", start);
   }
 
+  if(stride != 1 || fraction > 0) {
+    return each_entry_sampled(log, start, stride, fraction, seed);
+  }
+
+  if(log->read_ahead_depth > 0) {
+    return each_entry_read_ahead(self, log, start);
+  }
+
   CHECK_CALL(fseek(log->file, start * sizeof(struct acct_v3), SEEK_SET), 0);
 
-  for(i = start; i < log->num_entries; ++i) {
-    VALUE entry = pacct_entry_new(log);
+  //The position is re-checked on each pass in case the block changes the
+  //file (e.g. with drop_before) or closes it.
+  for(;;) {
+    VALUE entry;
+    pacct_log_check_closed(log);
+    if(ftell(log->file) / (long)sizeof(struct acct_v3) >= log->num_entries) {
+      break;
+    }
+    entry = pacct_entry_new(log);
     rb_yield(entry);
   }
 
@@ -280,7 +1198,7 @@ static VALUE last_entry(VALUE self) {
   long pos;
   VALUE entry;
 
-  Data_Get_Struct(self, PacctLog, log);
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
 
   pacct_log_check_closed(log);
 
@@ -304,11 +1222,22 @@ static VALUE last_entry(VALUE self) {
 static VALUE get_num_entries(VALUE self) {
   PacctLog* log;
 
-  Data_Get_Struct(self, PacctLog, log);
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
 
   return INT2NUM(log->num_entries);
 }
 
+/*
+ *Returns the name of the file
+ */
+static VALUE get_filename(VALUE self) {
+  PacctLog* log;
+
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
+
+  return rb_str_new2(log->filename);
+}
+
 /*
  *call-seq:
  *  write_entry(entry)
@@ -321,9 +1250,9 @@ static VALUE write_entry(VALUE self, VALUE entry) {
   long pos;
   struct acct_v3* acct;
 
-  Data_Get_Struct(self, PacctLog, log);
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
   pacct_log_check_closed(log);
-  Data_Get_Struct(entry, struct acct_v3, acct);
+  TypedData_Get_Struct(entry, struct acct_v3, &pacct_entry_type, acct);
 
   pos = ftell(log->file);
   CHECK_CALL(fseek(log->file, 0, SEEK_END), 0);
@@ -339,13 +1268,648 @@ static VALUE write_entry(VALUE self, VALUE entry) {
   return Qnil;
 }
 
+//Process tree reconstruction
+
+typedef struct {
+  uint32_t pid;
+  uint32_t ppid;
+  uint32_t btime;
+  float etime;
+  long parent;
+  //Number of children whose totals haven't been added to this node yet
+  long pending;
+  int matched;
+  //Inclusive totals for the subtree rooted at this node
+  unsigned long long cpu_ticks;
+  double wall_time;
+  unsigned long long memory;
+  long processes;
+} ProcessTreeNode;
+
+//Key used to look up processes by ID and start time
+typedef struct {
+  uint32_t pid;
+  uint32_t btime;
+  long index;
+} ProcessTreeKey;
+
+//Criteria that select the roots of the subtrees returned by process_tree
+typedef struct {
+  int active;
+  int has_command_name;
+  char command_name[ACCT_COMM];
+  int has_user_id;
+  uint32_t user_id;
+  int has_group_id;
+  uint32_t group_id;
+  int has_process_id;
+  uint32_t process_id;
+} ProcessTreeFilter;
+
+//A selected subtree root and a copy of its record
+typedef struct {
+  long index;
+  unsigned long long cpu_ticks;
+  double wall_time;
+  unsigned long long memory;
+  long processes;
+  struct acct_v3 record;
+} ProcessTreeResult;
+
+static int process_tree_key_cmp(const void* a, const void* b) {
+  const ProcessTreeKey* ka = (const ProcessTreeKey*) a;
+  const ProcessTreeKey* kb = (const ProcessTreeKey*) b;
+  if(ka->pid != kb->pid) {
+    return ka->pid < kb->pid ? -1 : 1;
+  }
+  if(ka->btime != kb->btime) {
+    return ka->btime < kb->btime ? -1 : 1;
+  }
+  return (ka->index > kb->index) - (ka->index < kb->index);
+}
+
+//Sorts results by inclusive CPU time (descending), then by position in the file
+static int process_tree_result_cmp(const void* a, const void* b) {
+  const ProcessTreeResult* ra = (const ProcessTreeResult*) a;
+  const ProcessTreeResult* rb = (const ProcessTreeResult*) b;
+  if(ra->cpu_ticks != rb->cpu_ticks) {
+    return ra->cpu_ticks > rb->cpu_ticks ? -1 : 1;
+  }
+  return (ra->index > rb->index) - (ra->index < rb->index);
+}
+
+static void process_tree_parse_filter(VALUE where, ProcessTreeFilter* filter) {
+  VALUE value;
+  size_t found = 0;
+
+  memset(filter, 0, sizeof(ProcessTreeFilter));
+  if(where == Qnil) {
+    return;
+  }
+  Check_Type(where, T_HASH);
+  filter->active = 1;
+
+  value = rb_hash_lookup2(where, ID2SYM(id_command_name), Qundef);
+  if(value != Qundef) {
+    ++found;
+    filter->has_command_name = 1;
+    strncpy(filter->command_name, StringValueCStr(value), ACCT_COMM - 1);
+    filter->command_name[ACCT_COMM - 1] = '\0';
+  }
+  value = rb_hash_lookup2(where, ID2SYM(id_user_id), Qundef);
+  if(value != Qundef) {
+    ++found;
+    filter->has_user_id = 1;
+    filter->user_id = NUM2UINT(value);
+  }
+  value = rb_hash_lookup2(where, ID2SYM(id_group_id), Qundef);
+  if(value != Qundef) {
+    ++found;
+    filter->has_group_id = 1;
+    filter->group_id = NUM2UINT(value);
+  }
+  value = rb_hash_lookup2(where, ID2SYM(id_process_id), Qundef);
+  if(value != Qundef) {
+    ++found;
+    filter->has_process_id = 1;
+    filter->process_id = NUM2UINT(value);
+  }
+
+  if(found != RHASH_SIZE(where)) {
+    rb_raise(rb_eArgError, "Unknown criterion for process_tree; expected :command_name, :user_id, :group_id, or :process_id");
+  }
+}
+
+static int process_tree_filter_matches(const ProcessTreeFilter* filter, const struct acct_v3* record) {
+  if(filter->has_command_name && strncmp(filter->command_name, record->ac_comm, ACCT_COMM) != 0) {
+    return 0;
+  }
+  if(filter->has_user_id && filter->user_id != record->ac_uid) {
+    return 0;
+  }
+  if(filter->has_group_id && filter->group_id != record->ac_gid) {
+    return 0;
+  }
+  if(filter->has_process_id && filter->process_id != record->ac_pid) {
+    return 0;
+  }
+  return 1;
+}
+
+//Finds the record of the process that spawned the given one
+//
+//Process IDs are reused, so the parent is the most recent process with the
+//right ID that started no later than the child and was still running when the
+//child started. The kernel rounds the start time down from the exit time and
+//rounds the elapsed time down separately, so a child can be stamped a second
+//before its parent, and the exit time can be off by a second too.
+static long process_tree_find_parent(ProcessTreeNode* nodes, ProcessTreeKey* keys, long num_nodes, long i) {
+  ProcessTreeNode* node = nodes + i;
+  long low = 0, high = num_nodes;
+  long candidate;
+
+  //Find the first key that comes after (ppid, btime + 1).
+  while(low < high) {
+    long mid = low + (high - low) / 2;
+    if(keys[mid].pid < node->ppid || (keys[mid].pid == node->ppid && (uint64_t)keys[mid].btime <= (uint64_t)node->btime + 1)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  for(candidate = low - 1; candidate >= 0 && keys[candidate].pid == node->ppid; --candidate) {
+    ProcessTreeNode* parent = nodes + keys[candidate].index;
+    if(keys[candidate].index == i) {
+      continue;
+    }
+    //A process stamped after the child can't also be its child.
+    if(parent->btime > node->btime && parent->ppid == node->pid) {
+      continue;
+    }
+    if((double)parent->btime + parent->etime + 1.0 >= (double)node->btime) {
+      return keys[candidate].index;
+    }
+    //Any earlier process with this ID exited even sooner.
+    break;
+  }
+
+  return -1;
+}
+
+/*
+ *call-seq:
+ *  process_tree(where: nil, top: nil) -> [{entry:, cpu_time:, wall_time:, memory:, processes:}, ...]
+ *
+ *Reconstructs the process tree from the parent process IDs in the file and
+ *returns the inclusive resource usage of each selected subtree
+ *
+ *If where is nil, the selected subtrees are the ones rooted at processes whose
+ *parents are not in the file. Otherwise, where is a Hash of criteria
+ *(:command_name, :user_id, :group_id, and/or :process_id), and every process
+ *that matches all of them is the root of a selected subtree.
+ *
+ *Results are sorted by inclusive CPU time in descending order. If top is
+ *given, only that many results are returned. Entries are only created for the
+ *returned roots.
+ */
+static VALUE process_tree(int argc, VALUE* argv, VALUE self) {
+  PacctLog* log;
+  VALUE opts, where = Qnil, top_value = Qnil, results;
+  ProcessTreeFilter filter;
+  ProcessTreeNode* nodes;
+  ProcessTreeKey* keys;
+  ProcessTreeResult* selected;
+  struct acct_v3* buf;
+  long* queue;
+  long num_nodes, num_selected = 0, queue_head = 0, queue_tail = 0;
+  long top = -1;
+  long pos, i;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  if(opts != Qnil) {
+    where = rb_hash_lookup(opts, ID2SYM(id_where));
+    top_value = rb_hash_lookup(opts, ID2SYM(id_top));
+  }
+  process_tree_parse_filter(where, &filter);
+  if(top_value != Qnil) {
+    top = NUM2LONG(top_value);
+    if(top < 0) {
+      rb_raise(rb_eArgError, "top must not be negative");
+    }
+  }
+
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
+  pacct_log_check_closed(log);
+
+  num_nodes = log->num_entries;
+  if(num_nodes == 0) {
+    return rb_ary_new();
+  }
+
+  pos = ftell(log->file);
+  CHECK_CALL(fseek(log->file, 0, SEEK_SET), 0);
+
+  nodes = malloc(num_nodes * sizeof(ProcessTreeNode));
+  keys = malloc(num_nodes * sizeof(ProcessTreeKey));
+  queue = malloc(num_nodes * sizeof(long));
+  buf = malloc(RECORDS_PER_READ * sizeof(struct acct_v3));
+  if(!(nodes && keys && queue && buf)) {
+    free(nodes);
+    free(keys);
+    free(queue);
+    free(buf);
+    rb_raise(cNoMemoryError, "Out of memory");
+  }
+
+  //Load the fields needed to build the tree.
+  for(i = 0; i < num_nodes;) {
+    size_t to_read = num_nodes - i < RECORDS_PER_READ ? num_nodes - i : RECORDS_PER_READ;
+    size_t j;
+    if(fread(buf, sizeof(struct acct_v3), to_read, log->file) != to_read) {
+      free(nodes);
+      free(keys);
+      free(queue);
+      free(buf);
+      rb_raise(rb_eIOError, "Unable to read record from accounting file '%s'", log->filename);
+    }
+    for(j = 0; j < to_read; ++j, ++i) {
+      struct acct_v3* record = buf + j;
+      ProcessTreeNode* node = nodes + i;
+      node->pid = record->ac_pid;
+      node->ppid = record->ac_ppid;
+      node->btime = record->ac_btime;
+      node->etime = record->ac_etime;
+      node->parent = -1;
+      node->pending = 0;
+      node->matched = filter.active && process_tree_filter_matches(&filter, record);
+      node->cpu_ticks = (unsigned long long)comp_t_to_ulong(record->ac_utime) + comp_t_to_ulong(record->ac_stime);
+      node->wall_time = record->ac_etime;
+      node->memory = comp_t_to_ulong(record->ac_mem) * 1024 / pageSize;
+      node->processes = 1;
+      keys[i].pid = record->ac_pid;
+      keys[i].btime = record->ac_btime;
+      keys[i].index = i;
+    }
+  }
+
+  //Link each process to its parent.
+  qsort(keys, num_nodes, sizeof(ProcessTreeKey), process_tree_key_cmp);
+  for(i = 0; i < num_nodes; ++i) {
+    long parent = process_tree_find_parent(nodes, keys, num_nodes, i);
+    nodes[i].parent = parent;
+    if(parent >= 0) {
+      ++nodes[parent].pending;
+    }
+  }
+  free(keys);
+
+  //Roll totals up from the leaves. Each node is queued once all of its
+  //children have been added to it.
+  for(i = 0; i < num_nodes; ++i) {
+    if(nodes[i].pending == 0) {
+      queue[queue_tail++] = i;
+    }
+  }
+  while(queue_head < queue_tail) {
+    ProcessTreeNode* node = nodes + queue[queue_head++];
+    ProcessTreeNode* parent;
+    if(!filter.active && node->parent < 0) {
+      node->matched = 1;
+    }
+    if(node->matched) {
+      ++num_selected;
+    }
+    if(node->parent < 0) {
+      continue;
+    }
+    parent = nodes + node->parent;
+    parent->cpu_ticks += node->cpu_ticks;
+    parent->wall_time += node->wall_time;
+    parent->memory += node->memory;
+    parent->processes += node->processes;
+    if(--(parent->pending) == 0) {
+      queue[queue_tail++] = node->parent;
+    }
+  }
+  free(queue);
+
+  selected = malloc((num_selected ? num_selected : 1) * sizeof(ProcessTreeResult));
+  if(!selected) {
+    free(nodes);
+    free(buf);
+    rb_raise(cNoMemoryError, "Out of memory");
+  }
+  num_selected = 0;
+  for(i = 0; i < num_nodes; ++i) {
+    //Nodes in a cycle (which only corrupt files should have) never get queued.
+    if(nodes[i].matched && nodes[i].pending == 0) {
+      ProcessTreeResult* result = selected + num_selected++;
+      result->index = i;
+      result->cpu_ticks = nodes[i].cpu_ticks;
+      result->wall_time = nodes[i].wall_time;
+      result->memory = nodes[i].memory;
+      result->processes = nodes[i].processes;
+    }
+  }
+  free(nodes);
+  free(buf);
+
+  qsort(selected, num_selected, sizeof(ProcessTreeResult), process_tree_result_cmp);
+  if(top >= 0 && top < num_selected) {
+    num_selected = top;
+  }
+
+  for(i = 0; i < num_selected; ++i) {
+    if(fseek(log->file, selected[i].index * sizeof(struct acct_v3), SEEK_SET) != 0 ||
+        fread(&selected[i].record, sizeof(struct acct_v3), 1, log->file) != 1) {
+      free(selected);
+      rb_raise(rb_eIOError, "Unable to read record from accounting file '%s'", log->filename);
+    }
+  }
+  if(fseek(log->file, pos, SEEK_SET) != 0) {
+    free(selected);
+    rb_raise(rb_eIOError, "Unable to seek in accounting file '%s'", log->filename);
+  }
+
+  results = rb_ary_new2(num_selected);
+  for(i = 0; i < num_selected; ++i) {
+    ProcessTreeResult* result = selected + i;
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(id_entry), pacct_entry_from_record(&result->record));
+    rb_hash_aset(hash, ID2SYM(id_cpu_time), ULL2NUM(result->cpu_ticks / ticksPerSecond));
+    rb_hash_aset(hash, ID2SYM(id_wall_time), rb_float_new(result->wall_time));
+    rb_hash_aset(hash, ID2SYM(id_memory), ULL2NUM(result->memory));
+    rb_hash_aset(hash, ID2SYM(id_processes), LONG2NUM(result->processes));
+    rb_ary_push(results, hash);
+  }
+  free(selected);
+
+  return results;
+}
+
+//Counts the leading records that exited before the given time
+static long pacct_log_count_before(PacctLog* log, unsigned long time) {
+  struct acct_v3 buf[RECORDS_PER_READ];
+  long count = 0;
+
+  CHECK_CALL(fseek(log->file, 0, SEEK_SET), 0);
+  while(count < log->num_entries) {
+    size_t to_read = log->num_entries - count < RECORDS_PER_READ ? log->num_entries - count : RECORDS_PER_READ;
+    size_t j;
+    if(fread(buf, sizeof(struct acct_v3), to_read, log->file) != to_read) {
+      rb_raise(rb_eIOError, "Unable to read record from accounting file '%s'", log->filename);
+    }
+    for(j = 0; j < to_read; ++j) {
+      if((double)buf[j].ac_btime + buf[j].ac_etime >= (double)time) {
+        return count;
+      }
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+//Copies every record after the first num_dropped into a new file and puts it
+//in place of the old one
+//
+//Returns 0 on success or an errno value on failure.
+static int pacct_log_copy_tail(PacctLog* log, long num_dropped) {
+  int fd = fileno(log->file);
+  int tmp_fd;
+  int e = 0;
+  size_t filename_len = strlen(log->filename);
+  char* tmp_filename;
+  char buf[64 * 1024];
+  off_t offset = (off_t)num_dropped * sizeof(struct acct_v3);
+  struct stat st;
+
+  if(fstat(fd, &st) != 0) {
+    return errno;
+  }
+
+  tmp_filename = malloc(filename_len + sizeof(".XXXXXX"));
+  if(!tmp_filename) {
+    return ENOMEM;
+  }
+  memcpy(tmp_filename, log->filename, filename_len);
+  memcpy(tmp_filename + filename_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  tmp_fd = mkstemp(tmp_filename);
+  if(tmp_fd < 0) {
+    e = errno;
+    free(tmp_filename);
+    return e;
+  }
+
+  for(;;) {
+    ssize_t num_read = pread(fd, buf, sizeof(buf), offset);
+    ssize_t num_written = 0;
+    if(num_read < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      e = errno;
+      break;
+    }
+    if(num_read == 0) {
+      break;
+    }
+    while(num_written < num_read) {
+      ssize_t result = write(tmp_fd, buf + num_written, num_read - num_written);
+      if(result < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        e = errno;
+        break;
+      }
+      num_written += result;
+    }
+    if(e) {
+      break;
+    }
+    offset += num_read;
+  }
+
+  if(!e && fchmod(tmp_fd, st.st_mode & 07777) != 0) {
+    e = errno;
+  }
+  if(!e) {
+    //Keeping the owner is best-effort; it requires privileges.
+    if(fchown(tmp_fd, st.st_uid, st.st_gid) != 0) {
+      errno = 0;
+    }
+    if(fsync(tmp_fd) != 0) {
+      e = errno;
+    }
+  }
+  if(close(tmp_fd) != 0 && !e) {
+    e = errno;
+  }
+  if(!e && rename(tmp_filename, log->filename) != 0) {
+    e = errno;
+  }
+  if(e) {
+    unlink(tmp_filename);
+    free(tmp_filename);
+    return e;
+  }
+  free(tmp_filename);
+
+  fclose(log->file);
+  log->file = fopen(log->filename, "r+b");
+  if(!log->file) {
+    return errno;
+  }
+
+  return 0;
+}
+
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+//Checks whether blocks of the given size can be collapsed out of files on the
+//log's filesystem by trying it on a scratch file next to the log
+static int pacct_log_probe_collapse(PacctLog* log, off_t block_size) {
+  size_t filename_len = strlen(log->filename);
+  char* tmp_filename;
+  int fd;
+  int supported = 0;
+
+  tmp_filename = malloc(filename_len + sizeof(".XXXXXX"));
+  if(!tmp_filename) {
+    return 0;
+  }
+  memcpy(tmp_filename, log->filename, filename_len);
+  memcpy(tmp_filename + filename_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  fd = mkstemp(tmp_filename);
+  if(fd >= 0) {
+    if(ftruncate(fd, block_size * 2) == 0) {
+      supported = fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, block_size) == 0;
+    }
+    close(fd);
+    unlink(tmp_filename);
+  }
+  free(tmp_filename);
+
+  return supported;
+}
+#endif
+
+/*
+ *call-seq:
+ *  drop_before(index, exact: false) -> count
+ *  drop_before(time, exact: false) -> count
+ *
+ *Removes records from the start of the file and returns the number removed
+ *
+ *If given an Integer, the records before that index are removed. If given a
+ *Time, the leading records of processes that exited before that time are
+ *removed.
+ *
+ *Where the filesystem supports it, the records are removed in place by
+ *collapsing whole filesystem blocks out of the file. Unless exact is true, the
+ *cut is rounded down to a block boundary, so up to a block's worth of extra
+ *records may be kept. Otherwise, the remaining records are copied into a new
+ *file that replaces the old one; note that the kernel keeps writing to the old
+ *file until accounting is turned on again for the new one.
+ *
+ *The log must have been opened for writing. Its entry count and read position
+ *are adjusted to match the new contents. Other Pacct::Log objects open on the
+ *same file (in this process or others) are not updated: after an in-place
+ *collapse, their entry counts and positions are stale and reading may fail,
+ *so they should be reopened.
+ */
+static VALUE drop_before(int argc, VALUE* argv, VALUE self) {
+  PacctLog* log;
+  VALUE limit, opts;
+  int exact = 0;
+  int fd, e = 0;
+  long num_dropped;
+  long pos;
+  off_t num_bytes;
+
+  rb_scan_args(argc, argv, "1:", &limit, &opts);
+  if(opts != Qnil) {
+    exact = RTEST(rb_hash_lookup(opts, ID2SYM(id_exact)));
+  }
+
+  TypedData_Get_Struct(self, PacctLog, &pacct_log_type, log);
+  pacct_log_check_closed(log);
+
+  fd = fileno(log->file);
+  if((fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+    rb_raise(rb_eIOError, "Accounting file '%s' is not open for writing", log->filename);
+  }
+
+  //A read-ahead iteration doesn't keep the stdio position up to date.
+  pos = log->read_ahead ? (long)(log->read_ahead->start + log->read_ahead->consumed) : ftell(log->file);
+
+  if(rb_obj_is_kind_of(limit, cTime)) {
+    num_dropped = pacct_log_count_before(log, NUM2ULONG(rb_funcall(limit, id_to_i, 0)));
+  } else {
+    num_dropped = NUM2LONG(limit);
+    if(num_dropped < 0 || num_dropped > log->num_entries) {
+      rb_raise(rb_eRangeError, "Index %li is out of range", num_dropped);
+    }
+  }
+
+  if(num_dropped == 0) {
+    CHECK_CALL(fseek(log->file, pos, SEEK_SET), 0);
+    return INT2NUM(0);
+  }
+
+  if(fflush(log->file) != 0) {
+    pacct_log_raise_errno(log, errno, "flush");
+  }
+  num_bytes = (off_t)num_dropped * sizeof(struct acct_v3);
+
+  if(num_dropped == log->num_entries) {
+    if(ftruncate(fd, 0) != 0) {
+      pacct_log_raise_errno(log, errno, "truncate");
+    }
+  } else {
+    int collapsed = 0;
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+    struct stat st;
+    if(log->collapse_support >= 0 && fstat(fd, &st) == 0 && st.st_blksize > 0 && st.st_blksize % sizeof(struct acct_v3) == 0) {
+      off_t block_bytes = num_bytes - num_bytes % st.st_blksize;
+      if(exact && block_bytes != num_bytes) {
+        block_bytes = 0;
+      }
+      if(block_bytes > 0) {
+        if(fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, block_bytes) == 0) {
+          log->collapse_support = 1;
+          collapsed = 1;
+          num_bytes = block_bytes;
+          num_dropped = block_bytes / sizeof(struct acct_v3);
+        } else if(errno == EOPNOTSUPP || errno == ENOSYS) {
+          log->collapse_support = -1;
+        } else if(errno != EINVAL) {
+          pacct_log_raise_errno(log, errno, "collapse");
+        }
+      } else if(!exact) {
+        //No whole block can be collapsed. Keeping the records is only right
+        //if collapsing works here at all; otherwise they're copied below.
+        if(log->collapse_support == 0) {
+          log->collapse_support = pacct_log_probe_collapse(log, st.st_blksize) ? 1 : -1;
+        }
+        if(log->collapse_support > 0) {
+          CHECK_CALL(fseek(log->file, pos, SEEK_SET), 0);
+          return INT2NUM(0);
+        }
+      }
+    }
+#endif
+    if(!collapsed) {
+      e = pacct_log_copy_tail(log, num_dropped);
+      if(e) {
+        if(!log->file) {
+          //The old file was replaced but couldn't be reopened.
+          log->num_entries = 0;
+        }
+        pacct_log_raise_errno(log, e, "rewrite");
+      }
+    }
+  }
+
+  log->num_entries -= num_dropped;
+  ++log->generation;
+  pos = pos > num_bytes ? pos - num_bytes : 0;
+  //Seeking also discards anything stdio has buffered from the old contents.
+  CHECK_CALL(fseek(log->file, pos, SEEK_SET), 0);
+
+  return LONG2NUM(num_dropped);
+}
+
 //Methods of Pacct::Entry
 /*
  *Returns the process ID
  */
 static VALUE get_process_id(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return INT2NUM(data->ac_pid);
 }
@@ -355,59 +1919,68 @@ static VALUE get_process_id(VALUE self) {
  */
 static VALUE set_process_id(VALUE self, VALUE pid) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   data->ac_pid = NUM2UINT(pid);
 
   return Qnil;
 }
 
+/*
+ *Returns the parent process ID
+ */
+static VALUE get_parent_process_id(VALUE self) {
+  struct acct_v3* data;
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+
+  return INT2NUM(data->ac_ppid);
+}
+
+/*
+ *Sets the parent process ID
+ */
+static VALUE set_parent_process_id(VALUE self, VALUE pid) {
+  struct acct_v3* data;
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
+
+  data->ac_ppid = NUM2UINT(pid);
+
+  return Qnil;
+}
+
 /*
  *Returns the ID of the user who executed the command
  */
 static VALUE get_user_id(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return INT2NUM(data->ac_uid);
 }
 
 /*
  *Returns the name of the user who executed the command
+ *
+ *The String is frozen and shared by every entry with the same user.
  */
 static VALUE get_user_name(VALUE self) {
   struct acct_v3* data;
-  struct passwd* pw_data;
-  VALUE id, name;
-  Data_Get_Struct(self, struct acct_v3, data);
-
-  //If there's a cached user name, return it.
-  id = UINT2NUM(data->ac_uid);
-  name = rb_hash_aref(known_users_by_id, id);
-  if(name != Qnil) {
-    return name;
-  }
+  const char* name;
+  int e = 0;
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
-  //Otherwise, get the user name from the OS.
-  errno = 0;
-  pw_data = getpwuid(data->ac_uid);
-  if(!pw_data) {
+  name = name_cache_get_name(&user_cache, data->ac_uid, os_user_name, &e);
+  if(!name) {
     char buf[512];
     VALUE err;
-    int e = errno;
     snprintf(buf, 512, "Unable to obtain user name for ID %u", data->ac_uid);
-    if(e == 0) {
-        e = ENODATA;
-    }
     err = rb_funcall(cSystemCallError, id_new, 2, rb_str_new2(buf), INT2NUM(e));
     rb_exc_raise(err);
   }
 
-  //Cache the user name.
-  name = rb_str_new2(pw_data->pw_name);
-  rb_hash_aset(known_users_by_id, id, name);
-
-  return name;
+  return pacct_interned_str(name, strlen(name));
 }
 
 /*
@@ -415,35 +1988,22 @@ static VALUE get_user_name(VALUE self) {
  */
 static VALUE set_user_name(VALUE self, VALUE name) {
   struct acct_v3* data;
-  struct passwd* pw_data;
   char* c_name = StringValueCStr(name);
-  VALUE id;
-  Data_Get_Struct(self, struct acct_v3, data);
+  uint32_t id;
+  int e;
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
-  id = rb_hash_aref(known_users_by_name, name);
-  if(id != Qnil) {
-    data->ac_uid = NUM2UINT(id);
-    return Qnil;
-  }
-
-  errno = 0;
-  pw_data = getpwnam(c_name);
-  if(!pw_data) {
+  e = name_cache_get_id(&user_cache, c_name, os_user_id, &id);
+  if(e) {
     char buf[512];
     VALUE err;
-    int e = errno;
     snprintf(buf, 512, "Unable to obtain user ID for name '%s'", c_name);
-    if(e == 0) {
-        e = ENODATA;
-    }
     err = rb_funcall(cSystemCallError, id_new, 2, rb_str_new2(buf), INT2NUM(e));
     rb_exc_raise(err);
   }
 
-  id = UINT2NUM(pw_data->pw_uid);
-  rb_hash_aset(known_users_by_name, name, id);
-
-  data->ac_uid = pw_data->pw_uid;
+  data->ac_uid = id;
 
   return Qnil;
 }
@@ -453,44 +2013,32 @@ static VALUE set_user_name(VALUE self, VALUE name) {
  */
 static VALUE get_group_id(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return INT2NUM(data->ac_gid);
 }
 
 /*
  *Returns the group name of the user who executed the command
+ *
+ *The String is frozen and shared by every entry with the same group.
  */
 static VALUE get_group_name(VALUE self) {
   struct acct_v3* data;
-  struct group* group_data;
-  VALUE name, id;
-  Data_Get_Struct(self, struct acct_v3, data);
-
-  id = UINT2NUM(data->ac_gid);
-  name = rb_hash_aref(known_groups_by_id, id);
-  if(name != Qnil) {
-    return name;
-  }
+  const char* name;
+  int e = 0;
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
-  errno = 0;
-  group_data = getgrgid(data->ac_gid);
-  if(!group_data) {
+  name = name_cache_get_name(&group_cache, data->ac_gid, os_group_name, &e);
+  if(!name) {
     char buf[512];
     VALUE err;
-    int e = errno;
     snprintf(buf, 512, "Unable to obtain group name for ID %u", data->ac_gid);
-    if(e == 0) {
-      e = ENODATA;
-    }
     err = rb_funcall(cSystemCallError, id_new, 2, rb_str_new2(buf), INT2NUM(e));
     rb_exc_raise(err);
   }
 
-  name = rb_str_new2(group_data->gr_name);
-  rb_hash_aset(known_groups_by_id, id, name);
-
-  return name;
+  return pacct_interned_str(name, strlen(name));
 }
 
 /*
@@ -498,35 +2046,22 @@ static VALUE get_group_name(VALUE self) {
  */
 static VALUE set_group_name(VALUE self, VALUE name) {
   struct acct_v3* data;
-  struct group* group_data;
-  VALUE id;
   char* c_name = StringValueCStr(name);
-  Data_Get_Struct(self, struct acct_v3, data);
-
-  id = rb_hash_aref(known_groups_by_name, name);
-  if(id != Qnil) {
-    data->ac_gid = NUM2UINT(id);
-    return Qnil;
-  }
+  uint32_t id;
+  int e;
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
-  errno = 0;
-  group_data = getgrnam(c_name);
-  if(!group_data) {
+  e = name_cache_get_id(&group_cache, c_name, os_group_id, &id);
+  if(e) {
     char buf[512];
     VALUE err;
-    int e = errno;
     snprintf(buf, 512, "Unable to obtain group ID for name '%s'", c_name);
-    if(e == 0) {
-      e = ENODATA;
-    }
     err = rb_funcall(cSystemCallError, id_new, 2, rb_str_new2(buf), INT2NUM(e));
     rb_exc_raise(err);
   }
 
-  id = UINT2NUM(group_data->gr_gid);
-  rb_hash_aset(known_groups_by_name, name, id);
-
-  data->ac_gid = group_data->gr_gid;
+  data->ac_gid = id;
 
   return Qnil;
 }
@@ -536,7 +2071,7 @@ static VALUE set_group_name(VALUE self, VALUE name) {
  */
 static VALUE get_user_time(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return INT2NUM(comp_t_to_ulong(data->ac_utime) / ticksPerSecond);
 }
@@ -546,7 +2081,8 @@ static VALUE get_user_time(VALUE self) {
  */
 static VALUE set_user_time(VALUE self, VALUE value) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   data->ac_utime = ulong_to_comp_t(NUM2ULONG(value) * ticksPerSecond);
 
@@ -558,7 +2094,7 @@ static VALUE set_user_time(VALUE self, VALUE value) {
  */
 static VALUE get_system_time(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return INT2NUM(comp_t_to_ulong(data->ac_stime) / ticksPerSecond);
 }
@@ -568,7 +2104,8 @@ static VALUE get_system_time(VALUE self) {
  */
 static VALUE set_system_time(VALUE self, VALUE value) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   data->ac_stime = ulong_to_comp_t(NUM2ULONG(value) * ticksPerSecond);
 
@@ -580,7 +2117,7 @@ static VALUE set_system_time(VALUE self, VALUE value) {
  */
 static VALUE get_cpu_time(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return INT2NUM((comp_t_to_ulong(data->ac_utime) + comp_t_to_ulong(data->ac_stime)) / ticksPerSecond);
 }
@@ -590,7 +2127,7 @@ static VALUE get_cpu_time(VALUE self) {
  */
 static VALUE get_wall_time(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return rb_float_new(data->ac_etime);
 }
@@ -600,7 +2137,8 @@ static VALUE get_wall_time(VALUE self) {
  */
 static VALUE set_wall_time(VALUE self, VALUE value) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   data->ac_etime = NUM2DBL(value);
 
@@ -612,9 +2150,22 @@ static VALUE set_wall_time(VALUE self, VALUE value) {
  */
 static VALUE get_start_time(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+
+  return rb_time_new(data->ac_btime, 0);
+}
+
+/*
+ *Returns the task's start time as an Integer number of seconds since the
+ *epoch
+ *
+ *This avoids creating a Time object.
+ */
+static VALUE get_start_epoch(VALUE self) {
+  struct acct_v3* data;
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
-  return rb_funcall(cTime, id_at, 1, INT2NUM(data->ac_btime));
+  return UINT2NUM(data->ac_btime);
 }
 
 /*
@@ -622,7 +2173,8 @@ static VALUE get_start_time(VALUE self) {
  */
 static VALUE set_start_time(VALUE self, VALUE value) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   data->ac_btime = NUM2UINT(rb_funcall(value, id_to_i, 0));
 
@@ -634,7 +2186,7 @@ static VALUE set_start_time(VALUE self, VALUE value) {
  */
 static VALUE get_average_mem_usage(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   //Why divided by page size?
   return INT2NUM(comp_t_to_ulong(data->ac_mem) * 1024 / pageSize);
@@ -645,7 +2197,8 @@ static VALUE get_average_mem_usage(VALUE self) {
  */
 static VALUE set_average_mem_usage(VALUE self, VALUE value) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   data->ac_mem = ulong_to_comp_t(NUM2ULONG(value) * pageSize / 1024);
 
@@ -654,12 +2207,14 @@ static VALUE set_average_mem_usage(VALUE self, VALUE value) {
 
 /*
  *Returns the first 15 characters of the command name
+ *
+ *The String is frozen and shared by every entry with the same command name.
  */
 static VALUE get_command_name(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
-  return rb_str_new2(data->ac_comm);
+  return pacct_interned_str(data->ac_comm, strnlen(data->ac_comm, ACCT_COMM));
 }
 
 /*
@@ -667,7 +2222,8 @@ static VALUE get_command_name(VALUE self) {
  */
 static VALUE set_command_name(VALUE self, VALUE name) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   strncpy(data->ac_comm, StringValueCStr(name), ACCT_COMM - 1);
   data->ac_comm[ACCT_COMM - 1] = '\0';
@@ -680,7 +2236,7 @@ static VALUE set_command_name(VALUE self, VALUE name) {
  */
 static VALUE get_exit_code(VALUE self) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
 
   return INT2NUM(data->ac_exitcode);
 }
@@ -690,7 +2246,8 @@ static VALUE get_exit_code(VALUE self) {
  */
 static VALUE set_exit_code(VALUE self, VALUE value) {
   struct acct_v3* data;
-  Data_Get_Struct(self, struct acct_v3, data);
+  TypedData_Get_Struct(self, struct acct_v3, &pacct_entry_type, data);
+  rb_check_frozen(self);
 
   data->ac_exitcode = NUM2UINT(value);
 
@@ -734,7 +2291,7 @@ static VALUE test_read_failure(VALUE self) {
 
 static VALUE test_write_failure(VALUE self) {
   PacctLog* ptr;
-  VALUE log = Data_Make_Struct(cLog, PacctLog, 0, pacct_log_free, ptr);
+  VALUE log = TypedData_Make_Struct(cLog, PacctLog, &pacct_log_type, ptr);
   VALUE entry = pacct_entry_new(NULL);
   const char* filename = "spec/pacct_spec.rb";
   ptr->num_entries = 0;
@@ -774,20 +2331,32 @@ void Init_pacct_c() {
   cSystemCallError = rb_const_get(rb_cObject, rb_intern("SystemCallError"));
   cNoMemoryError = rb_const_get(rb_cObject, rb_intern("NoMemoryError"));
 
-  id_at = rb_intern("at");
   id_new = rb_intern("new");
   id_to_i = rb_intern("to_i");
-
-  //To consider: is there any place that these can be unregistered?
-  rb_gc_register_address(&known_users_by_name);
-  rb_gc_register_address(&known_groups_by_name);
-  rb_gc_register_address(&known_users_by_id);
-  rb_gc_register_address(&known_groups_by_id);
-
-  known_users_by_name = rb_hash_new();
-  known_groups_by_name = rb_hash_new();
-  known_users_by_id = rb_hash_new();
-  known_groups_by_id = rb_hash_new();
+  id_where = rb_intern("where");
+  id_top = rb_intern("top");
+  id_command_name = rb_intern("command_name");
+  id_user_id = rb_intern("user_id");
+  id_group_id = rb_intern("group_id");
+  id_process_id = rb_intern("process_id");
+  id_entry = rb_intern("entry");
+  id_cpu_time = rb_intern("cpu_time");
+  id_wall_time = rb_intern("wall_time");
+  id_memory = rb_intern("memory");
+  id_processes = rb_intern("processes");
+  id_exact = rb_intern("exact");
+  id_cursor = rb_intern("cursor");
+  id_each_entry = rb_intern("each_entry");
+  id_buffer_size = rb_intern("buffer_size");
+  id_depth = rb_intern("depth");
+  id_stride = rb_intern("stride");
+  id_fraction = rb_intern("fraction");
+  id_seed = rb_intern("seed");
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  //All mutable state is either per-object or in the locked name caches.
+  rb_ext_ractor_safe(true);
+#endif
 
   //Define Ruby modules/objects/methods.
   mPacct = rb_define_module("Pacct");
@@ -801,17 +2370,30 @@ void Init_pacct_c() {
    *Represents an entry in a Pacct::File
    */
   cEntry = rb_define_class_under(mPacct, "Entry", rb_cObject);
+  rb_undef_alloc_func(cLog);
+  rb_undef_alloc_func(cEntry);
   rb_define_singleton_method(cLog, "new", pacct_log_new, -1);
   rb_define_method(cLog, "initialize", pacct_log_init, 2);
   rb_define_method(cLog, "each_entry", each_entry, -1);
+  rb_define_method(cLog, "read_ahead", read_ahead, -1);
+  rb_define_method(cLog, "sample", sample, -1);
   rb_define_method(cLog, "last_entry", last_entry, 0);
   rb_define_method(cLog, "num_entries", get_num_entries, 0);
+  rb_define_method(cLog, "filename", get_filename, 0);
+  /*
+   *Size of a record in bytes
+   */
+  rb_define_const(cLog, "RECORD_SIZE", INT2NUM(sizeof(struct acct_v3)));
   rb_define_method(cLog, "write_entry", write_entry, 1);
+  rb_define_method(cLog, "process_tree", process_tree, -1);
+  rb_define_method(cLog, "drop_before", drop_before, -1);
   rb_define_method(cLog, "close", pacct_log_close, 0);
 
   rb_define_singleton_method(cEntry, "new", ruby_pacct_entry_new, 0);
   rb_define_method(cEntry, "process_id", get_process_id, 0);
   rb_define_method(cEntry, "process_id=", set_process_id, 1);
+  rb_define_method(cEntry, "parent_process_id", get_parent_process_id, 0);
+  rb_define_method(cEntry, "parent_process_id=", set_parent_process_id, 1);
   rb_define_method(cEntry, "user_id", get_user_id, 0);
   rb_define_method(cEntry, "user_name", get_user_name, 0);
   rb_define_method(cEntry, "user_name=", set_user_name, 1);
@@ -827,6 +2409,7 @@ void Init_pacct_c() {
   rb_define_method(cEntry, "wall_time=", set_wall_time, 1);
   rb_define_method(cEntry, "start_time", get_start_time, 0);
   rb_define_method(cEntry, "start_time=", set_start_time, 1);
+  rb_define_method(cEntry, "start_epoch", get_start_epoch, 0);
   rb_define_method(cEntry, "memory", get_average_mem_usage, 0);
   rb_define_method(cEntry, "memory=", set_average_mem_usage, 1);
   rb_define_method(cEntry, "exit_code", get_exit_code, 0);
@@ -8,3 +8,8 @@ module Pacct
   
 end
 
+require "pacct/file_state"
+require "pacct/rollup"
+require "pacct/cursor"
+require "pacct/estimate"
+
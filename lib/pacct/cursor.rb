@@ -0,0 +1,128 @@
+module Pacct
+  ##
+  #A persistent position in an accounting file for consumers that must see
+  #each record exactly once
+  #
+  #The state file holds the device and inode of the file, the byte offset just
+  #past the last consumed record, a checksum of that record, and a checksum of
+  #the first record in the file. Reading with the cursor only moves its
+  #position in memory; call #commit once the records have been delivered to
+  #make the new position durable. If the process dies first, the next run
+  #starts again from the last commit.
+  #
+  #If the file has been rotated since the last commit, the rest of the old
+  #file is read from its rotated name (i.e. "pacct.1") before starting on the
+  #new file, so records written just before rotation aren't lost. If there is
+  #no rotated copy, the last consumed record is looked for in the new file in
+  #case it replaced the old one (e.g. after Log#drop_before had to copy). If
+  #the consumed records have been dropped from the start of the file,
+  #reading resumes from its first record.
+  class Cursor
+    #Path to the state file
+    attr_reader :path
+
+    ##
+    #Opens the cursor stored at path
+    #
+    #If the file doesn't exist yet, the cursor starts at the beginning of the
+    #first accounting file that it reads.
+    def initialize(path)
+      @path = path
+      @committed = nil
+      if File.exist?(path)
+        @committed = File.open(path, 'rb') { |f| Marshal.load(f) }
+        unless @committed.is_a?(Hash) && [:device, :inode, :offset, :checksum].all? { |k| @committed.key?(k) }
+          raise IOError, "Cursor file '#{path}' is invalid"
+        end
+      end
+      @position = @committed && @committed.dup
+    end
+
+    ##
+    #Returns the byte offset just past the last consumed record
+    def offset
+      @position ? @position[:offset] : 0
+    end
+
+    ##
+    #call-seq:
+    #  each_entry(log) {|entry| ...}
+    #
+    #Yields each entry after the last one consumed, advancing the cursor
+    #
+    #An entry only counts as consumed once the block returns normally, so if
+    #the block breaks or raises, the cursor stays just before that entry.
+    def each_entry(log)
+      return enum_for(:each_entry, log) unless block_given?
+      filename = log.filename
+      stat = File.stat(filename)
+      same_file = !@position || same_file?(stat, @position)
+      unless same_file
+        rotated = FileState.find_rotated(filename, @position[:device], @position[:inode])
+        if rotated
+          rotated_log = Log.new(rotated)
+          begin
+            consume(rotated_log, true) { |entry| yield entry }
+          ensure
+            rotated_log.close
+          end
+          @position = nil
+        end
+      end
+      consume(log, same_file) { |entry| yield entry }
+      nil
+    end
+
+    ##
+    #Makes the current position durable
+    #
+    #The state file is replaced atomically, and the commit survives a crash
+    #once this returns.
+    def commit
+      return unless @position
+      FileState.save(@path, @position)
+      @committed = @position.dup
+      nil
+    end
+
+    ##
+    #Moves the cursor back to the last committed position
+    def rollback
+      @position = @committed && @committed.dup
+      nil
+    end
+
+    private
+
+    def same_file?(stat, position)
+      stat.dev == position[:device] && stat.ino == position[:inode]
+    end
+
+    #Yields the unconsumed entries from log and updates the position
+    #
+    #If same_file is false, the last consumed record is looked for in log in
+    #case it replaced the file that the position was taken from.
+    def consume(log, same_file)
+      File.open(log.filename, 'rb') do |io|
+        stat = io.stat
+        offset = @position ? FileState.resume_offset(io, @position, same_file) : 0
+        unless offset
+          raise IOError, "Unable to find the last consumed record of cursor '#{@path}' in '#{io.path}'"
+        end
+        @position = {device: stat.dev, inode: stat.ino, offset: offset}
+        begin
+          if offset / Log::RECORD_SIZE < log.num_entries
+            log.each_entry(offset / Log::RECORD_SIZE) do |entry|
+              yield entry
+              @position[:offset] += Log::RECORD_SIZE
+            end
+          end
+        ensure
+          offset = @position[:offset]
+          @position[:checksum] = offset > 0 ? FileState.record_checksum(io, offset - Log::RECORD_SIZE) : nil
+          @position[:first_checksum] = FileState.record_checksum(io, 0)
+        end
+      end
+    end
+  end
+end
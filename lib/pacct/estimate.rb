@@ -0,0 +1,82 @@
+module Pacct
+  ##
+  #An estimate of a mean and total over all of the entries in a file, computed
+  #from a random sample of them, with its sampling error
+  #
+  #  estimate = Pacct::Estimate.new(log.num_entries)
+  #  log.sample(1000).each { |entry| estimate << entry.cpu_time }
+  #  estimate.total          #Estimated total CPU time
+  #  estimate.total_error    #Standard error of the total
+  #
+  #The standard errors include the finite population correction, so they are
+  #zero when every entry was sampled.
+  class Estimate
+    #Number of entries in the whole population
+    attr_reader :population
+    #Number of values that have been added
+    attr_reader :sample_size
+
+    ##
+    #Estimates aggregates over population entries
+    def initialize(population)
+      @population = population
+      @sample_size = 0
+      @mean = 0.0
+      #Sum of squared differences from the mean (Welford's method)
+      @m2 = 0.0
+    end
+
+    ##
+    #Runs the block on a sample of n entries from log and returns the estimate
+    #of the values that it returns
+    def self.from_sample(log, n, seed: nil)
+      estimate = new(log.num_entries)
+      log.sample(n, seed: seed).each { |entry| estimate << yield(entry) }
+      estimate
+    end
+
+    ##
+    #Adds a sampled value
+    def <<(value)
+      @sample_size += 1
+      delta = value - @mean
+      @mean += delta / @sample_size
+      @m2 += delta * (value - @mean)
+      self
+    end
+
+    ##
+    #Returns the estimated mean per entry
+    def mean
+      @mean
+    end
+
+    ##
+    #Returns the estimated total over all entries
+    def total
+      @mean * @population
+    end
+
+    ##
+    #Returns the standard error of the mean
+    def standard_error
+      return Float::INFINITY if @sample_size < 2 && @sample_size < @population
+      return 0.0 if @sample_size >= @population
+      variance = @m2 / (@sample_size - 1)
+      correction = (@population - @sample_size).to_f / @population
+      Math.sqrt(variance / @sample_size * correction)
+    end
+
+    ##
+    #Returns the standard error of the total
+    def total_error
+      standard_error * @population
+    end
+
+    ##
+    #Returns the range that the total is in with about 95% confidence
+    def total_interval(z = 1.96)
+      (total - z * total_error)..(total + z * total_error)
+    end
+  end
+end
@@ -0,0 +1,103 @@
+require 'zlib'
+
+module Pacct
+  ##
+  #Helpers for the classes that keep their place in an accounting file between
+  #runs (Pacct::Rollup and Pacct::Cursor)
+  module FileState # :nodoc:
+    #Suffixes that rotated accounting files are searched for under
+    ROTATED_SUFFIXES = ['.1', '.0', '-1'].map(&:freeze).freeze
+
+    ##
+    #Returns the name of the rotated copy of filename that has the given device
+    #and inode numbers, or nil if there isn't one
+    def self.find_rotated(filename, device, inode)
+      ROTATED_SUFFIXES.each do |suffix|
+        candidate = filename + suffix
+        next unless File.exist?(candidate)
+        stat = File.stat(candidate)
+        return candidate if stat.ino == inode && stat.dev == device
+      end
+      nil
+    end
+
+    ##
+    #Replaces the file at path with the given object in Marshal format
+    #
+    #The new contents are written to a temporary file and renamed into place,
+    #so a crash leaves either the old state or the new one. The directory is
+    #synced after the rename so that the new state survives a crash once this
+    #returns.
+    def self.save(path, state)
+      tmp_path = "#{path}.#{Process.pid}.tmp"
+      File.open(tmp_path, 'wb') do |f|
+        Marshal.dump(state, f)
+        f.flush
+        f.fsync
+      end
+      File.rename(tmp_path, path)
+      File.open(File.dirname(path), 'r') { |dir| dir.fsync }
+    end
+
+    ##
+    #Returns the CRC32 of the record at the given byte offset in io, or nil if
+    #there isn't a whole record there
+    def self.record_checksum(io, offset)
+      data = io.pread(Log::RECORD_SIZE, offset)
+      data.bytesize == Log::RECORD_SIZE ? Zlib.crc32(data) : nil
+    rescue EOFError
+      nil
+    end
+
+    ##
+    #Finds where reading should resume in io after a previous reader stopped
+    #
+    #position is a Hash with the byte :offset just past the last record that
+    #was read, the :checksum of that record, and the :first_checksum of the
+    #first record in the file at the time. same_file tells whether io is the
+    #file that position was taken from.
+    #
+    #If the first record is unchanged, the last one must still be at its old
+    #offset. Otherwise records were dropped from the start of the file (e.g. by
+    #Log#drop_before), so the last record can only have moved toward the start
+    #and is searched for there by checksum. If it isn't found, everything that
+    #was read has been dropped and reading resumes from the first record.
+    #
+    #Returns nil if the file has changed in some other way.
+    def self.resume_offset(io, position, same_file)
+      offset = position[:offset]
+      return 0 if offset == 0
+      size = io.stat.size
+      size -= size % Log::RECORD_SIZE
+      if same_file && record_checksum(io, 0) == position[:first_checksum]
+        return nil unless offset <= size && record_checksum(io, offset - Log::RECORD_SIZE) == position[:checksum]
+        return offset
+      end
+      found = find_record(io, [offset - Log::RECORD_SIZE, size].min, position[:checksum])
+      found ? found + Log::RECORD_SIZE : 0
+    end
+
+    #Number of records that find_record reads at a time
+    SEARCH_RECORDS = 1024
+    private_constant :SEARCH_RECORDS
+
+    ##
+    #Returns the offset of the last record before limit in io with the given
+    #checksum, or nil if there isn't one
+    def self.find_record(io, limit, checksum)
+      chunk_end = limit - limit % Log::RECORD_SIZE
+      while chunk_end > 0
+        chunk_start = [chunk_end - SEARCH_RECORDS * Log::RECORD_SIZE, 0].max
+        data = io.pread(chunk_end - chunk_start, chunk_start)
+        (data.bytesize / Log::RECORD_SIZE - 1).downto(0) do |i|
+          if Zlib.crc32(data.byteslice(i * Log::RECORD_SIZE, Log::RECORD_SIZE)) == checksum
+            return chunk_start + i * Log::RECORD_SIZE
+          end
+        end
+        chunk_end = chunk_start
+      end
+      nil
+    end
+    private_class_method :find_record
+  end
+end
@@ -0,0 +1,164 @@
+module Pacct
+  ##
+  #Time-bucketed resource usage totals that are kept on disk and updated
+  #incrementally as records are appended to an accounting file
+  #
+  #The store remembers the device, inode, byte offset, and checksum of the
+  #last record that was processed, so each update only reads the new records.
+  #If the file has been rotated since the last update, the rest of the old
+  #file is read from its rotated name (i.e. "pacct.1") before starting on the
+  #new one.
+  class Rollup
+    #Version of the on-disk store format
+    FORMAT = 2
+
+    #Width of each time bucket in seconds
+    attr_reader :bucket
+    #Names of the Pacct::Entry methods whose values are used as grouping keys
+    attr_reader :by
+    #Totals, keyed by [bucket start time (as an Integer), *grouping values]
+    #
+    #Each value is [cpu_time, wall_time, memory, processes].
+    attr_reader :rows
+
+    ##
+    #call-seq:
+    #  update(log, store_path, bucket: 3600, by: []) -> rollup
+    #
+    #Adds the records that have been appended to log since the last call to
+    #the rollup stored at store_path, creating the store if needed
+    def self.update(log, store_path, bucket: 3600, by: [])
+      by = by.map(&:to_sym)
+      if File.exist?(store_path)
+        rollup = load(store_path)
+        unless rollup.bucket == bucket && rollup.by == by
+          raise ArgumentError, "Rollup store '#{store_path}' uses bucket: #{rollup.bucket}, by: #{rollup.by.inspect}"
+        end
+      else
+        rollup = new(bucket, by)
+      end
+      rollup.update(log)
+      rollup.save(store_path)
+      rollup
+    end
+
+    ##
+    #Loads a rollup from a store file
+    def self.load(store_path)
+      state = File.open(store_path, 'rb') { |f| Marshal.load(f) }
+      unless state.is_a?(Hash) && state[:format] == FORMAT
+        raise IOError, "Rollup store '#{store_path}' has an unknown format"
+      end
+      new(state[:bucket], state[:by], state)
+    end
+
+    ##
+    #Creates an empty rollup, or restores one from the state that #save wrote
+    def initialize(bucket = 3600, by = [], state = {})
+      raise ArgumentError, "Bucket width must be positive" unless bucket > 0
+      @bucket = bucket
+      @by = by.map(&:to_sym)
+      @device = state[:device]
+      @inode = state[:inode]
+      @offset = state.fetch(:offset, 0)
+      @checksum = state[:checksum]
+      @first_checksum = state[:first_checksum]
+      @rows = state.fetch(:rows, {})
+    end
+
+    ##
+    #Adds the records that have been appended to log since the last update
+    #
+    #If records have been dropped from the start of the file since then, the
+    #last record that was processed is found again by its checksum.
+    def update(log)
+      filename = log.filename
+      stat = File.stat(filename)
+      offset = 0
+      if @inode
+        if stat.ino == @inode && stat.dev == @device
+          offset = resume_offset(log, true)
+        elsif (rotated = FileState.find_rotated(filename, @device, @inode))
+          rotated_log = Log.new(rotated)
+          begin
+            add_from(rotated_log, resume_offset(rotated_log, true))
+          ensure
+            rotated_log.close
+          end
+        else
+          #Look for the last processed record in the replacement file.
+          offset = resume_offset(log, false)
+        end
+      end
+      @offset = add_from(log, offset)
+      @device = stat.dev
+      @inode = stat.ino
+      File.open(filename, 'rb') do |io|
+        @checksum = @offset > 0 ? FileState.record_checksum(io, @offset - Log::RECORD_SIZE) : nil
+        @first_checksum = FileState.record_checksum(io, 0)
+      end
+      self
+    end
+
+    ##
+    #Writes the rollup to a store file
+    #
+    #The store is replaced atomically, so an interrupted save leaves the
+    #previous state intact.
+    def save(store_path)
+      state = {
+        format: FORMAT,
+        bucket: @bucket,
+        by: @by,
+        device: @device,
+        inode: @inode,
+        offset: @offset,
+        checksum: @checksum,
+        first_checksum: @first_checksum,
+        rows: @rows,
+      }
+      FileState.save(store_path, state)
+    end
+
+    ##
+    #call-seq:
+    #  each {|time, keys, totals| ...}
+    #
+    #Yields the start of each bucket, its grouping values, and a Hash of its
+    #totals (:cpu_time, :wall_time, :memory, and :processes)
+    def each
+      @rows.each_pair do |key, (cpu_time, wall_time, memory, processes)|
+        totals = {cpu_time: cpu_time, wall_time: wall_time, memory: memory, processes: processes}
+        yield Time.at(key[0]), key[1..-1], totals
+      end
+    end
+
+    private
+
+    #Finds where to resume reading log
+    def resume_offset(log, same_file)
+      position = {offset: @offset, checksum: @checksum, first_checksum: @first_checksum}
+      offset = File.open(log.filename, 'rb') { |io| FileState.resume_offset(io, position, same_file) }
+      raise IOError, "Unable to find the last processed record in '#{log.filename}'" unless offset
+      offset
+    end
+
+    #Adds the records that start at the given byte offset and returns the
+    #offset just past the last one
+    def add_from(log, offset)
+      start = offset / Log::RECORD_SIZE
+      return offset if start > log.num_entries
+      log.each_entry(start) do |entry|
+        time = entry.start_epoch
+        key = [time - time % @bucket]
+        @by.each { |name| key << entry.public_send(name) }
+        row = (@rows[key] ||= [0, 0.0, 0, 0])
+        row[0] += entry.cpu_time
+        row[1] += entry.wall_time
+        row[2] += entry.memory
+        row[3] += 1
+      end
+      log.num_entries * Log::RECORD_SIZE
+    end
+  end
+end
@@ -0,0 +1,92 @@
+require 'spec_helper'
+
+require 'fileutils'
+
+describe Pacct::Cursor do
+  let(:cursor_path) { 'snapshot/cursor_state' }
+
+  def append_pids(filename, pids)
+    append_entries(filename, pids.map { |pid| {process_id: pid} })
+  end
+
+  def consume(filename, cursor = Pacct::Cursor.new(cursor_path))
+    pids = []
+    log = Pacct::Log.new(filename)
+    log.each_entry(cursor: cursor) { |e| pids << e.process_id }
+    log.close
+    pids
+  end
+
+  after(:each) do
+    ['snapshot/pacct_cursor', 'snapshot/pacct_cursor.1', cursor_path].each do |f|
+      FileUtils.rm(f) if File.exist?(f)
+    end
+  end
+
+  it "resumes from the last commit" do
+    append_pids('snapshot/pacct_cursor', [1, 2, 3])
+    cursor = Pacct::Cursor.new(cursor_path)
+    consume('snapshot/pacct_cursor', cursor).should eql [1, 2, 3]
+    #Nothing was committed, so a new cursor starts over.
+    consume('snapshot/pacct_cursor').should eql [1, 2, 3]
+    cursor.commit
+    cursor.offset.should eql 3 * Pacct::Log::RECORD_SIZE
+
+    append_pids('snapshot/pacct_cursor', [4, 5])
+    cursor = Pacct::Cursor.new(cursor_path)
+    consume('snapshot/pacct_cursor', cursor).should eql [4, 5]
+    cursor.rollback
+    consume('snapshot/pacct_cursor', cursor).should eql [4, 5]
+    consume('snapshot/pacct_cursor', cursor).should eql []
+  end
+
+  it "doesn't consume the entry that the block exits early on" do
+    append_pids('snapshot/pacct_cursor', [1, 2, 3])
+    cursor = Pacct::Cursor.new(cursor_path)
+    log = Pacct::Log.new('snapshot/pacct_cursor')
+    log.each_entry(cursor: cursor) { |e| break if e.process_id == 2 }
+    cursor.commit
+    consume("snapshot/pacct_cursor").should eql [2, 3]
+  end
+
+  it "reads the rest of rotated files before new ones" do
+    append_pids('snapshot/pacct_cursor', [1, 2])
+    cursor = Pacct::Cursor.new(cursor_path)
+    consume('snapshot/pacct_cursor', cursor)
+    cursor.commit
+    append_pids('snapshot/pacct_cursor', [3])
+    FileUtils.mv('snapshot/pacct_cursor', 'snapshot/pacct_cursor.1')
+    append_pids('snapshot/pacct_cursor', [4])
+    cursor = Pacct::Cursor.new(cursor_path)
+    consume('snapshot/pacct_cursor', cursor).should eql [3, 4]
+    cursor.commit
+    consume('snapshot/pacct_cursor').should eql []
+  end
+
+  it "finds its place after records are dropped from the start of the file" do
+    append_pids('snapshot/pacct_cursor', [1, 2, 3])
+    cursor = Pacct::Cursor.new(cursor_path)
+    consume('snapshot/pacct_cursor', cursor)
+    cursor.commit
+    append_pids('snapshot/pacct_cursor', [4])
+    log = Pacct::Log.new('snapshot/pacct_cursor', 'r+b')
+    log.drop_before(1, exact: true)
+    log.close
+    consume('snapshot/pacct_cursor').should eql [4]
+  end
+
+  it "resumes from the first record after the consumed records are collapsed out of the file" do
+    append_pids('snapshot/pacct_cursor', 1 .. 64)
+    cursor = Pacct::Cursor.new(cursor_path)
+    consume('snapshot/pacct_cursor', cursor).length.should eql 64
+    cursor.commit
+    append_pids('snapshot/pacct_cursor', 65 .. 200)
+    #64 records fill whole blocks, so this collapses the file in place where
+    #the filesystem supports it.
+    log = Pacct::Log.new('snapshot/pacct_cursor', 'r+b')
+    log.drop_before(64).should eql 64
+    log.close
+    consume('snapshot/pacct_cursor').should eql (65 .. 200).to_a
+    consume('snapshot/pacct_cursor').should eql (65 .. 200).to_a
+  end
+end
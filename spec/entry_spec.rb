@@ -1,5 +1,7 @@
 require 'spec_helper'
 
+require 'objspace'
+
 describe Pacct::Entry do
   it "correctly converts \"comp_t\"s to integers" do
     comp_t_to_ulong = Pacct::Test.method(:comp_t_to_ulong)
@@ -38,6 +40,70 @@ describe Pacct::Entry do
     e.command_name.should eql 'some_very_long_'
   end
   
+  it "reports its memory usage" do
+    e = Pacct::Entry.new
+    if RUBY_VERSION >= '3.3'
+      #The 64-byte record is embedded after the 32-byte object header, so the
+      #object only takes up the smallest slot that holds both.
+      slot_size = GC.stat_heap.values.map { |h| h[:slot_size] }.sort.find { |s| s >= 32 + 64 }
+      ObjectSpace.memsize_of(e).should eql slot_size
+    else
+      ObjectSpace.memsize_of(e).should eql GC::INTERNAL_CONSTANTS[:RVALUE_SIZE] + 64
+    end
+    ObjectSpace.memsize_of(Pacct::Log.new('snapshot/pacct')).should > 0
+  end
+
+  it "shares frozen name strings between entries" do
+    a = Pacct::Entry.new
+    b = Pacct::Entry.new
+    a.command_name = 'make'
+    b.command_name = 'make'
+    a.command_name.frozen?.should eql true
+    a.command_name.equal?(b.command_name).should eql true
+    a.user_name.frozen?.should eql true
+    a.user_name.equal?(b.user_name).should eql true
+    a.group_name.equal?(b.group_name).should eql true
+    a.command_name.encoding.should eql Encoding::ASCII_8BIT
+    a.command_name = "caf\xC3\xA9".b
+    a.command_name.encoding.should eql Encoding::ASCII_8BIT
+    (a.command_name =~ /\xC3/n).should eql 3
+  end
+
+  it "returns the start time as an Integer" do
+    e = Pacct::Entry.new
+    e.start_time = Time.at(1349741116)
+    e.start_epoch.should eql 1349741116
+  end
+
+  it "can't be changed once frozen" do
+    e = Pacct::Entry.new
+    e.freeze
+    expect { e.process_id = 1 }.to raise_error(FrozenError)
+    expect { e.user_name = 'root' }.to raise_error(FrozenError)
+    expect { e.command_name = 'ls' }.to raise_error(FrozenError)
+  end
+
+  if defined?(Ractor)
+    it "can be shared with other Ractors" do
+      e = Pacct::Entry.new
+      e.process_id = 5
+      Ractor.make_shareable(e)
+      Ractor.shareable?(e).should eql true
+      Ractor.new(e) { |entry| [entry.process_id, entry.user_name] }.take.should eql [5, 'root']
+    end
+
+    it "can be used from other Ractors" do
+      r = Ractor.new do
+        entries = []
+        Pacct::Log.new('snapshot/pacct').each_entry do |entry|
+          entries << [entry.command_name, entry.user_name, entry.group_name]
+        end
+        entries
+      end
+      r.take.should eql [['accton', 'root', 'root']]
+    end
+  end
+
   it "raises an error when encountering unknown user/group IDs" do
     log = Pacct::Log.new('snapshot/pacct_invalid_ids')
     log.each_entry do |entry|
@@ -0,0 +1,21 @@
+require 'spec_helper'
+
+describe Pacct::Estimate do
+  it "has no error when the whole population is sampled" do
+    estimate = Pacct::Estimate.new(4)
+    [1, 2, 3, 6].each { |v| estimate << v }
+    estimate.mean.should eql 3.0
+    estimate.total.should eql 12.0
+    estimate.total_error.should eql 0.0
+  end
+
+  it "computes the standard error of a sample" do
+    estimate = Pacct::Estimate.new(101)
+    [1, 2, 3, 6].each { |v| estimate << v }
+    estimate.sample_size.should eql 4
+    #Sample variance is 14/3; corrected for a population of 101
+    estimate.standard_error.should be_within(1e-12).of(Math.sqrt(14.0 / 3 / 4 * 97 / 101))
+    estimate.total_interval.include?(303.0).should eql true
+    Pacct::Estimate.new(10).standard_error.should eql Float::INFINITY
+  end
+end
@@ -106,6 +106,225 @@ describe Pacct::Log do
     FileUtils.rm('snapshot/abc')
   end
 
+  let(:tree_data) do
+    [
+      #process_id, parent_process_id, command_name, start offset, wall_time, user_time
+      [100, 1, 'make', 0, 10.0, 1],
+      [101, 100, 'cc', 1, 2.0, 2],
+      [102, 101, 'as', 2, 1.0, 3],
+      [200, 1, 'sleep', 0, 5.0, 0],
+      #Process ID 100 is reused by a later process.
+      [100, 1, 'make', 100, 4.0, 2],
+      [103, 100, 'cc', 101, 1.0, 6],
+    ]
+  end
+
+  def write_tree_log(filename, start, rows)
+    FileUtils.rm_f(filename)
+    append_entries(filename, rows.map { |pid, ppid, command, offset, wall_time, user_time|
+      {process_id: pid, parent_process_id: ppid, command_name: command,
+       start_time: start + offset, wall_time: wall_time, user_time: user_time}
+    })
+  end
+
+  it "reconstructs process trees" do
+    start = Time.local(2012, 1, 1)
+    write_tree_log('snapshot/pacct_tree', start, tree_data)
+
+    log = Pacct::Log.new('snapshot/pacct_tree')
+    trees = log.process_tree
+    trees.length.should eql 3
+    trees.map { |t| t[:cpu_time] }.should eql [8, 6, 0]
+    trees.map { |t| t[:processes] }.should eql [2, 3, 1]
+    trees[0][:entry].start_time.should eql start + 100
+    trees[1][:wall_time].should eql 13.0
+
+    trees = log.process_tree(where: {command_name: 'cc'}, top: 1)
+    trees.length.should eql 1
+    trees[0][:entry].process_id.should eql 103
+    trees[0][:cpu_time].should eql 6
+
+    log.process_tree(where: {process_id: 101})[0][:processes].should eql 2
+    expect { log.process_tree(where: {bogus: 1}) }.to raise_error(ArgumentError)
+    FileUtils.rm('snapshot/pacct_tree')
+  end
+
+  it "links children whose start time was rounded to before their parent's" do
+    #A parent that ran from 100.9 to 101.85 is stamped 101, but a child that
+    #ran from 100.95 to 100.99 is stamped 100.
+    write_tree_log('snapshot/pacct_tree', Time.local(2012, 1, 1), [
+      [300, 1, 'sh', 1, 0.0, 1],
+      [301, 300, 'true', 0, 0.0, 2],
+    ])
+    log = Pacct::Log.new('snapshot/pacct_tree')
+    trees = log.process_tree
+    trees.length.should eql 1
+    trees[0][:entry].process_id.should eql 300
+    trees[0][:processes].should eql 2
+    trees[0][:cpu_time].should eql 3
+    log.close
+    FileUtils.rm('snapshot/pacct_tree')
+  end
+
+  it "drops records from the start of the file" do
+    log = write_numbered_log('snapshot/pacct_drop', 200)
+    log.each_entry(150) { |e| break }
+    log.drop_before(70, exact: true).should eql 70
+    log.num_entries.should eql 130
+    pids = []
+    log.each_entry { |e| pids << e.process_id }
+    pids.should eql (70...200).to_a
+    log.close
+
+    log = Pacct::Log.new('snapshot/pacct_drop', 'r+b')
+    log.num_entries.should eql 130
+    #Rounding to a block may keep some extra records.
+    dropped = log.drop_before(Time.at(1000 + 150))
+    dropped.should <= 80
+    log.num_entries.should eql 130 - dropped
+    log.last_entry.process_id.should eql 199
+    log.drop_before(log.num_entries).should eql 130 - dropped
+    log.num_entries.should eql 0
+    File.size('snapshot/pacct_drop').should eql 0
+    log.close
+    FileUtils.rm('snapshot/pacct_drop')
+  end
+
+  if File.directory?('/dev/shm')
+    it "copies records when the filesystem can't collapse them" do
+      #tmpfs doesn't support collapsing ranges.
+      log = write_numbered_log('/dev/shm/pacct_drop', 200)
+      log.drop_before(10).should eql 10
+      log.num_entries.should eql 190
+      log.each_entry { |e| e.process_id.should eql 10; break }
+      log.close
+      FileUtils.rm('/dev/shm/pacct_drop')
+    end
+  end
+
+  it "keeps the read position when dropping records" do
+    log = write_numbered_log('snapshot/pacct_drop', 10)
+    pids = []
+    log.each_entry do |e|
+      pids << e.process_id
+      log.drop_before(3, exact: true) if e.process_id == 4
+    end
+    pids.should eql (0...10).to_a
+    log.close
+    FileUtils.rm('snapshot/pacct_drop')
+  end
+
+  it "raises if the block closes the log" do
+    log = Pacct::Log.new('snapshot/pacct')
+    expect { log.each_entry { log.close } }.to raise_error(RuntimeError, /closed/)
+    log = Pacct::Log.new('snapshot/pacct')
+    expect { log.each_entry(stride: 2) { log.close } }.to raise_error(RuntimeError, /closed/)
+  end
+
+  it "reads ahead in the background" do
+    write_numbered_log('snapshot/pacct_read_ahead', 200).close
+    log = Pacct::Log.new('snapshot/pacct_read_ahead')
+    log.read_ahead(buffer_size: 1000, depth: 3).should eql log
+    pids = []
+    log.each_entry { |e| pids << e.process_id }
+    pids.should eql (0...200).to_a
+
+    pids = []
+    log.each_entry(190) { |e| pids << e.process_id }
+    pids.should eql (190...200).to_a
+
+    log.each_entry { |e| break if e.process_id == 50 }
+    log.last_entry.process_id.should eql 199
+    log.read_ahead(depth: 0)
+    pids = []
+    log.each_entry(195) { |e| pids << e.process_id }
+    pids.should eql (195...200).to_a
+
+    expect { log.read_ahead(buffer_size: 10) }.to raise_error(ArgumentError)
+    log.close
+    FileUtils.rm('snapshot/pacct_read_ahead')
+  end
+
+  it "follows changes that the block makes while reading ahead" do
+    log = write_numbered_log('snapshot/pacct_read_ahead', 200)
+    log.read_ahead(buffer_size: 1000, depth: 3)
+    pids = []
+    log.each_entry do |e|
+      pids << e.process_id
+      log.drop_before(64) if e.process_id == 100
+      log.drop_before(30, exact: true) if e.process_id == 150
+    end
+    pids.should eql (0...200).to_a
+    log.num_entries.should eql 200 - 64 - 30
+
+    pids = []
+    log.each_entry do |e|
+      pids << e.process_id
+      if e.process_id == 199
+        extra = Pacct::Entry.new
+        extra.process_id = 999
+        log.write_entry(extra)
+      end
+    end
+    pids.last(2).should eql [199, 999]
+
+    other = write_numbered_log('snapshot/pacct_read_ahead_other', 300)
+    expect {
+      log.each_entry do |e|
+        log.close
+        other.close
+        Pacct::Log.new('snapshot/pacct_read_ahead_other').close
+      end
+    }.to raise_error(RuntimeError, /closed/)
+    FileUtils.rm('snapshot/pacct_read_ahead')
+    FileUtils.rm('snapshot/pacct_read_ahead_other')
+  end
+
+  it "samples entries" do
+    write_numbered_log('snapshot/pacct_sample', 100).close
+    log = Pacct::Log.new('snapshot/pacct_sample')
+    pids = log.sample(10, seed: 1).map(&:process_id)
+    pids.length.should eql 10
+    pids.uniq.sort.should eql pids
+    log.sample(10, seed: 1).map(&:process_id).should eql pids
+    log.sample(1000).map(&:process_id).should eql (0...100).to_a
+    pids = log.sample(99, seed: 1).map(&:process_id)
+    pids.length.should eql 99
+    pids.uniq.sort.should eql pids
+    log.sample(0).should eql []
+
+    estimate = Pacct::Estimate.from_sample(log, 100) { |e| e.process_id }
+    estimate.total.should eql 4950.0
+    estimate.total_error.should eql 0.0
+
+    pids = []
+    log.each_entry(5, stride: 10) { |e| pids << e.process_id }
+    pids.should eql [5, 15, 25, 35, 45, 55, 65, 75, 85, 95]
+
+    pids = []
+    log.each_entry(fraction: 1) { |e| pids << e.process_id }
+    pids.should eql (0...100).to_a
+
+    pids = []
+    log.each_entry(fraction: 0.25, seed: 3) { |e| pids << e.process_id }
+    pids.uniq.sort.should eql pids
+    pids.length.should > 5
+    pids.length.should < 50
+    again = []
+    log.each_entry(fraction: 0.25, seed: 3) { |e| again << e.process_id }
+    again.should eql pids
+
+    expect { log.each_entry(stride: 0) { } }.to raise_error(ArgumentError)
+    expect { log.each_entry(fraction: 2) { } }.to raise_error(ArgumentError)
+    log.close
+    FileUtils.rm('snapshot/pacct_sample')
+  end
+
+  it "refuses to drop records from a read-only file" do
+    expect { @log.drop_before(1) }.to raise_error(IOError)
+    expect { Pacct::Log.new('snapshot/pacct', 'r+b').drop_before(2) }.to raise_error(RangeError)
+  end
+
   it "raises an error if an attempt is made to access the file after it has been closed" do
     log = Pacct::Log.new('/dev/null')
     log.close
@@ -113,6 +332,7 @@ describe Pacct::Log do
     expect { log.each_entry }.to raise_error(str)
     expect { log.write_entry(nil) }.to raise_error(str)
     expect { log.last_entry }.to raise_error(str)
+    expect { log.process_tree }.to raise_error(str)
   end
 end
 
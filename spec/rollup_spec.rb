@@ -0,0 +1,74 @@
+require 'spec_helper'
+
+require 'fileutils'
+
+describe Pacct::Rollup do
+  let(:store) { 'snapshot/rollup_store' }
+
+  #Appends entries given as [command_name, seconds after 7200, user_time]
+  def append_commands(filename, entries)
+    append_entries(filename, entries.map { |command, offset, user_time|
+      {command_name: command, start_time: Time.at(7200 + offset), wall_time: 1.0, user_time: user_time}
+    })
+  end
+
+  def update(filename)
+    log = Pacct::Log.new(filename)
+    rollup = Pacct::Rollup.update(log, store, bucket: 3600, by: [:command_name])
+    log.close
+    rollup
+  end
+
+  after(:each) do
+    ['snapshot/pacct_rollup', 'snapshot/pacct_rollup.1', store].each do |f|
+      FileUtils.rm(f) if File.exist?(f)
+    end
+  end
+
+  it "only adds new records on each update" do
+    append_commands('snapshot/pacct_rollup', [['make', 0, 1], ['cc', 10, 2]])
+    rollup = update('snapshot/pacct_rollup')
+    rollup.rows.should eql({[7200, 'make'] => [1, 1.0, 0, 1], [7200, 'cc'] => [2, 1.0, 0, 1]})
+
+    append_commands('snapshot/pacct_rollup', [['cc', 3600, 3]])
+    rollup = update('snapshot/pacct_rollup')
+    rollup.rows[[7200, 'cc']].should eql [2, 1.0, 0, 1]
+    rollup.rows[[10800, 'cc']].should eql [3, 1.0, 0, 1]
+
+    update('snapshot/pacct_rollup').rows.length.should eql 3
+    expect {
+      Pacct::Rollup.update(Pacct::Log.new('snapshot/pacct_rollup'), store, bucket: 60)
+    }.to raise_error(ArgumentError)
+  end
+
+  it "finishes rotated files before starting on new ones" do
+    append_commands('snapshot/pacct_rollup', [['make', 0, 1]])
+    update('snapshot/pacct_rollup')
+    append_commands('snapshot/pacct_rollup', [['make', 1, 1]])
+    FileUtils.mv('snapshot/pacct_rollup', 'snapshot/pacct_rollup.1')
+    append_commands('snapshot/pacct_rollup', [['make', 2, 1]])
+    rollup = update('snapshot/pacct_rollup')
+    rollup.rows.should eql({[7200, 'make'] => [3, 3.0, 0, 3]})
+    times = []
+    rollup.each { |time, keys, totals| times << [time, keys, totals[:processes]] }
+    times.should eql [[Time.at(7200), ['make'], 3]]
+  end
+
+  it "finds its place after records are dropped from the start of the file" do
+    append_commands('snapshot/pacct_rollup', (0 ... 300).map { |i| ['make', i, 1] })
+    update('snapshot/pacct_rollup')
+    log = Pacct::Log.new('snapshot/pacct_rollup', 'r+b')
+    log.drop_before(128, exact: true)
+    log.close
+    update('snapshot/pacct_rollup').rows[[7200, 'make']][3].should eql 300
+
+    append_commands('snapshot/pacct_rollup', (300 ... 310).map { |i| ['make', i, 1] })
+    update('snapshot/pacct_rollup').rows[[7200, 'make']][3].should eql 310
+
+    log = Pacct::Log.new('snapshot/pacct_rollup', 'r+b')
+    log.drop_before(log.num_entries, exact: true)
+    log.close
+    append_commands('snapshot/pacct_rollup', [['make', 310, 1]])
+    update('snapshot/pacct_rollup').rows[[7200, 'make']][3].should eql 311
+  end
+end
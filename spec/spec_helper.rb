@@ -4,3 +4,33 @@ if ENV['COVERAGE']
 end
 
 require 'pacct'
+
+require 'fileutils'
+
+module SpecHelpers
+  ##
+  #Appends an entry to filename for each Hash of attributes (e.g.
+  #{process_id: 1}), creating the file if needed
+  def append_entries(filename, attributes)
+    log = Pacct::Log.new(filename, File.exist?(filename) ? 'r+b' : 'w+b')
+    attributes.each do |attrs|
+      e = Pacct::Entry.new
+      attrs.each { |name, value| e.public_send("#{name}=", value) }
+      log.write_entry(e)
+    end
+    log.close
+  end
+
+  ##
+  #Writes a new file with n entries numbered from 0 and returns it open for
+  #reading and writing
+  def write_numbered_log(filename, n)
+    FileUtils.rm_f(filename)
+    append_entries(filename, (0 ... n).map { |i| {process_id: i, start_time: Time.at(1000 + i), wall_time: 1.0} })
+    Pacct::Log.new(filename, 'r+b')
+  end
+end
+
+RSpec.configure do |config|
+  config.include SpecHelpers
+end